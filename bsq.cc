@@ -5,8 +5,32 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <limits>
+#include <climits>
+#include <array>
 #include <algorithm>
-#include <deque>
+#include <numeric>
+#include <fstream>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <chrono>
+#include <queue>
+#include <map>
+#include <cstdio>
+#include <cstdlib>
+#include <csignal>
+#include <cerrno>
+#include <cmath>
+#include <cctype>
+#include <zlib.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <poll.h>
 
 
 #define HandleError(msg) \
@@ -14,32 +38,190 @@
 
 int Usage(std::string const &program) {
   std::cerr << "Usage: " << program
-            << " [-t CHAR] [-k N] [-w] [-f] [-h] FILE [KEY...]\n";
+            << " [-t CHAR] [-k N] [-w] [-c] [-f] [-n | -g] [-b] [-j N]"
+               " [--unordered] [--count | --exists] [--no-advise]\n"
+               "       " << std::string(program.size(), ' ')
+            << " [--populate SIZE] [--prefetch[=DEPTH]] [--row-table[=SIZE]]"
+               " [--interpolate] [--join]\n"
+               "       " << std::string(program.size(), ' ')
+            << " [-o N,N...] [-i INDEX] [--record-size SIZE"
+               " [--key-offset OFFSET] [--key-len LEN]] [-h] FILE [KEY...]\n";
+  std::cerr << "       " << program
+            << " index [-t CHAR] [-k N] [-f] [-B SIZE]"
+               " [--eytzinger | --bloom[=RATE]] FILE [INDEX]\n";
+  std::cerr << "       " << program
+            << " sort [-t CHAR] [-k N] [-f] [-n | -g] [-j N] [-S SIZE] [-T DIR]"
+               " FILE [OUTPUT]\n";
+  std::cerr << "       " << program
+            << " compress [-t CHAR] [-k N] [-B SIZE] [--record-size SIZE]"
+               " FILE [COMPRESSED]\n";
+  std::cerr << "       " << program
+            << " [-t CHAR] [-k N] [-w] [-f] [-n | -g] [--count | --exists]"
+               " [-i INDEX] --range LO HI\n"
+               "       " << std::string(program.size(), ' ')
+            << " [--exclude-lo] [--exclude-hi] FILE\n";
+  std::cerr << "       " << program
+            << " [-t CHAR] [-k N] [-w] [-f] [-i INDEX] --serve SOCKET"
+               " FILE\n";
   std::cerr << "\t-t CHAR: column separator. Default: tab\n";
-  std::cerr << "\t-k N: key column index. Default: 1\n";
+  std::cerr << "\t-k N: key column index. Default: 1\n"
+               "\t\tN,N...: up to 4 key columns of a composite key, compared"
+               " column by column\n";
   std::cerr << "\t-w: exact match only. Default: prefix match\n";
   std::cerr << "\t-c: check if the input is sorted. No search is performed\n";
   std::cerr << "\t-f: fold to upper case for keys\n";
+  std::cerr << "\t-n: compare the keys as decimal numbers, same as sort -n."
+               " Implies -w\n";
+  std::cerr << "\t-g: compare the keys as floating point numbers,"
+               " same as sort -g. Implies -w\n";
+  std::cerr << "\t-b: batch mode. Sort the keys, up to 16K at a time,"
+               " and share the binary search among them\n";
+  std::cerr << "\t-o N,N...: print only these columns of the matching rows,"
+               " delimited by CHAR\n";
+  std::cerr << "\t--count: print the number of matching rows of each key"
+               " instead of the rows\n";
+  std::cerr << "\t--exists: print 1 or 0 for each key, depending on whether"
+               " any row matches it\n";
+  std::cerr << "\t-j N: search the keys, or check the input with -c,"
+               " with N threads. Default: 1\n";
+  std::cerr << "\t--unordered: with -j, print the results of the keys"
+               " as soon as they are found\n";
+  std::cerr << "\t--no-advise: do not give the kernel access advice on FILE,"
+               " i.e., random access\n"
+               "\t\tfor the search and sequential for -c and the commands\n";
+  std::cerr << "\t--populate SIZE: read in FILE entirely upfront if it is"
+               " no larger than SIZE. Default: 0\n";
+  std::cerr << "\t--prefetch[=DEPTH]: read ahead both midpoints that the"
+               " binary search may probe next,\n"
+               "\t\tand DEPTH levels ahead. Default DEPTH: 1\n";
+  std::cerr << "\t--row-table[=SIZE]: keep the first row of each block of"
+               " SIZE bytes as the search finds it,\n"
+               "\t\tand probe it rather than scan for the beginning of a row."
+               " Default SIZE: 64K\n";
+  std::cerr << "\t--interpolate: probe where the key is expected to be,"
+               " for uniformly distributed keys\n";
+  std::cerr << "\t--join: search the keys, given in ascending order,"
+               " each from where the previous one\n"
+               "\t\tis found, as in a merge join\n";
+  std::cerr << "\t--range LO HI: print the rows whose key lies between"
+               " LO and HI, including the rows\n"
+               "\t\tthat match LO or HI, instead of searching keys\n";
+  std::cerr << "\t--exclude-lo, --exclude-hi: with --range, exclude the rows"
+               " that match LO or HI\n";
+  std::cerr << "\t--record-size SIZE: the rows are records of SIZE bytes,"
+               " which may be binary, with no row separator.\n"
+               "\t\tThe key is either the key columns within the record, or\n";
+  std::cerr << "\t--key-offset OFFSET, --key-len LEN: the LEN bytes at OFFSET"
+               " of the record. Default LEN: the rest of the record\n";
+  std::cerr << "\t-i INDEX: index of FILE created by the index command."
+               " May be given once for each type of index\n";
+  std::cerr << "\t-B SIZE: bytes of FILE covered by each index entry,"
+               " or each compressed block. Default: 4K, or 16K for compress\n";
+  std::cerr << "\t--eytzinger: create the packed index of the key prefixes"
+               " instead, searched in cache-friendly order\n";
+  std::cerr << "\t--bloom[=RATE]: create the Bloom filter of the keys instead,"
+               " which rules out the keys absent from FILE\n"
+               "\t\tfor -w with RATE of false positives. Default RATE: 0.01\n";
+  std::cerr << "\t-S SIZE: memory budget of the sort command. Default: 1G\n";
+  std::cerr << "\t-T DIR: directory for temporary files of the sort command."
+               " Default: $TMPDIR or /tmp\n";
+  std::cerr << "\t--serve SOCKET: keep FILE mapped and answer queries"
+               " on the Unix domain socket.\n"
+               "\t\tEach line received is a search key, which is answered"
+               " with the size of the matching rows in bytes on a line,"
+               " and then the rows\n";
   std::cerr << "\t-h: print this message\n";
   std::cerr << "\tFILE: input file to be read using mmap."
-               " Must be sorted by the key column\n";
+               " Must be sorted by the key column.\n"
+               "\tMay also be a file created by the compress command,"
+               " of which only the blocks searched are decompressed\n";
   std::cerr << "\tKEY: search key(s)."
-            << " Each key will be searched independently.\n";
-  std::cerr << "\tDefault: read from stdin delimited by LF\n";
+            << " Each key will be searched independently.\n"
+               "\tA composite key is given as its columns delimited by CHAR,"
+               " and may omit the trailing ones\n";
+  std::cerr << "\tDefault: read from stdin delimited by LF,"
+               " and searched as they arrive\n";
+  std::cerr << "\tINDEX: index file to create."
+               " Default: FILE.bsqi, FILE.bsqe with --eytzinger,"
+               " or FILE.bsqb with --bloom\n";
+  std::cerr << "\tOUTPUT: sorted file to create, which may be FILE itself."
+               " Default: stdout\n";
+  std::cerr << "\tCOMPRESSED: compressed file to create. Default: FILE.bsqz\n";
 
   return EXIT_FAILURE;
 }
 
+struct SparseIndex;
+struct EytzingerIndex;
+struct CompressedFile;
+struct RowTable;
+struct BloomFilter;
+
+/**
+ * Version of a file as of its last change, which tells whether the files
+ * created from it, e.g., an index, are stale
+ */
+struct FileStamp {
+  uint64_t inode;
+  int64_t mtime; // nanoseconds since the epoch
+
+  bool operator!=(FileStamp const &that) const noexcept {
+    return inode != that.inode || mtime != that.mtime;
+  }
+};
+
 struct Config {
+  // ordering of the key columns
+  enum class Order {
+    kBytes,   // lexicographic, default
+    kNumeric, // -n
+    kGeneral, // -g
+  };
+
   char col_sep = '\t';
   char row_sep = '\n';
   bool check = false;
   bool exact_match = false;
   bool fold = false;
-  uint8_t col = 1;
+  Order order = Order::kBytes;
+  bool batch = false;
+  bool join = false;
+  bool unordered = false;
+  bool count = false;
+  bool exists = false;
+  // whether to give the kernel access advice on the mmap
+  bool advise = true;
+  // levels of the binary search to read ahead
+  int prefetch = 0;
+  bool interpolate = false;
+  int jobs = 1;
+  // key columns in the order of comparison, e.g., {3, 5} for -k 3,5,
+  // followed by zeros
+  static constexpr int kMaxKeyColumns = 4;
+  std::array<uint8_t, kMaxKeyColumns> cols{{1}};
+  int num_cols = 1;
+  // rows of a fixed size with no row_sep, or 0 for rows delimited by row_sep
+  std::size_t record_size = 0;
+  // bytes of the record that make up the key, or 0 for the key columns
+  std::size_t key_offset = 0;
+  std::size_t key_len = 0;
+  // columns of the matching rows to print, e.g., {1, 4, 7} for -o 1,4,7.
+  // empty for the whole rows
+  std::vector<int> output_cols;
   // mmap
   char const *first = nullptr;
   char const *last = nullptr;
+  FileStamp stamp{};
+  // optional sparse index of the mmap
+  SparseIndex const *index = nullptr;
+  // optional packed index of the key prefixes of the mmap
+  EytzingerIndex const *eytzinger = nullptr;
+  // the database if compressed, in which case the mmap is not searched
+  CompressedFile const *compressed = nullptr;
+  // optional table of the first rows of the blocks of the mmap
+  RowTable const *row_table = nullptr;
+  // optional Bloom filter of the keys of the mmap, for -w
+  BloomFilter const *bloom = nullptr;
 };
 
 /**
@@ -68,6 +250,233 @@ auto ExtractArgument(It &pos, It last, F &&parse) {
   HandleError("Argument not found: " + *pos);
 }
 
+/**
+ * Same as ExtractArgument, but for a long option "--xx" that takes
+ * an argument "X" either from the current string {"--xx=X"}
+ * or the next string {"--xx", "X"}
+ */
+template<typename It, typename F>
+auto ExtractLongArgument(It &pos, It last, F &&parse) {
+  auto eq = pos->find('=');
+  if (eq != std::string::npos) {
+    return std::forward<F>(parse)(pos->substr(eq + 1));
+  } else if (std::next(pos) != last && !(++pos)->empty()) {
+    return std::forward<F>(parse)(*pos);
+  }
+  HandleError("Argument not found: " + *pos);
+}
+
+/**
+ * Parses a size in bytes with an optional K, M or G suffix, e.g., "64K"
+ */
+std::size_t ParseSize(std::string const &s) {
+  // std::stoull accepts a sign and wraps negative numbers around
+  if (s.empty() || !std::isdigit(static_cast<unsigned char>(s.front()))) {
+    HandleError("Invalid size: " + s);
+  }
+  std::size_t idx;
+  auto size = std::stoull(s, &idx);
+  if (idx + 1 == s.size()) {
+    switch (std::toupper(s.back())) {
+      case 'G':
+        size <<= 10;
+        // fallthrough
+      case 'M':
+        size <<= 10;
+        // fallthrough
+      case 'K':
+        size <<= 10;
+        break;
+      default:
+        HandleError("Invalid size: " + s);
+    }
+  } else if (idx != s.size()) {
+    HandleError("Invalid size: " + s);
+  }
+  return size;
+}
+
+/**
+ * Parses a list of column indices delimited by ',', e.g., "1,4,7"
+ */
+std::vector<int> ParseColumns(std::string const &s) {
+  const int max = std::numeric_limits<uint8_t>::max();
+  std::vector<int> cols;
+  std::string::size_type first = 0;
+  while (first <= s.size()) {
+    auto last = std::min(s.find(',', first), s.size());
+    auto col = std::stoi(s.substr(first, last - first));
+    if (col > max || col < 1)
+      HandleError("N must be within [1, " + std::to_string(max) + "]");
+    cols.push_back(col);
+    first = last + 1;
+  }
+  return cols;
+}
+
+/**
+ * Gives the kernel the access advice for the pages overlapping [first, last)
+ * of a mmap. It is only a hint, so failures are ignored
+ */
+void Advise(char const *first, char const *last, int advice) {
+  static const auto page_size = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+  if (first >= last) return;
+  auto addr = reinterpret_cast<uintptr_t>(first) & ~(page_size - 1);
+  madvise(reinterpret_cast<void *>(addr),
+          reinterpret_cast<uintptr_t>(last) - addr, advice);
+}
+
+/**
+ * Read-only mmap of an entire file, which is unmapped upon destruction
+ * Files no larger than populate_limit are read in entirely upfront
+ */
+struct MappedFile {
+  char const *first = nullptr;
+  char const *last = nullptr;
+  FileStamp stamp{};
+
+  explicit MappedFile(std::string const &filename,
+                      std::size_t populate_limit = 0) {
+    struct stat sb;
+    auto fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1) HandleError("Failed to open: " + filename);
+    if (fstat(fd, &sb) == -1) HandleError("Failed with fstat");
+    stamp.inode = sb.st_ino;
+    stamp.mtime = sb.st_mtim.tv_sec * INT64_C(1000000000) + sb.st_mtim.tv_nsec;
+    if (sb.st_size > 0) {
+      auto populate = static_cast<std::size_t>(sb.st_size) <= populate_limit;
+      auto flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+      if (populate) flags |= MAP_POPULATE;
+#endif // MAP_POPULATE
+      auto addr = mmap(nullptr, sb.st_size, PROT_READ, flags, fd, 0);
+      if (addr == MAP_FAILED) HandleError("mmap failed: " + filename);
+      first = reinterpret_cast<char const *>(addr);
+      last = first + sb.st_size;
+#ifndef MAP_POPULATE
+      if (populate) Advise(first, last, MADV_WILLNEED);
+#endif // MAP_POPULATE
+    }
+    close(fd);
+  }
+
+  MappedFile(MappedFile const &) = delete;
+  MappedFile &operator=(MappedFile const &) = delete;
+
+  ~MappedFile() {
+    if (first) munmap(const_cast<char *>(first), last - first);
+  }
+
+  std::size_t Size() const noexcept { return last - first; }
+};
+
+/**
+ * Buffered output that writes with a single writev per batch
+ *
+ * Write only references the given range, which thus must stay valid until
+ * flushed, e.g., rows of the mmap'ed file. Ranges adjacent in memory,
+ * such as consecutive rows, are merged into one. Copy stores its own copy
+ * of the range instead
+ *
+ * A writer without a file descriptor only collects the ranges,
+ * to be appended to another writer later on
+ */
+struct Writer {
+  static constexpr std::size_t kMaxRanges = 1024;    // IOV_MAX on Linux
+  static constexpr std::size_t kMaxSize = 1 << 22;   // flush threshold
+  static constexpr std::size_t kBlockSize = 1 << 12; // for copies
+
+  int fd;
+  std::vector<iovec> ranges;
+  std::size_t size = 0;
+  // storage of the copied ranges
+  std::vector<std::unique_ptr<char[]>> blocks;
+  std::size_t block_used = kBlockSize;
+
+  explicit Writer(int fd = -1) : fd(fd) {}
+
+  void Write(char const *first, char const *last) {
+    Append(first, last);
+    if (fd != -1 && (ranges.size() >= kMaxRanges || size >= kMaxSize))
+      Flush();
+  }
+
+  void Copy(char const *first, char const *last) {
+    std::size_t n = last - first;
+    if (block_used + n > kBlockSize) {
+      blocks.emplace_back(new char[std::max(n, kBlockSize)]);
+      block_used = 0;
+    }
+    auto dest = blocks.back().get() + block_used;
+    std::memcpy(dest, first, n);
+    block_used += n;
+    Write(dest, dest + n);
+  }
+
+  void Copy(std::string const &s) { Copy(s.data(), s.data() + s.size()); }
+
+  /**
+   * Appends all the ranges of that writer, taking over its copies
+   */
+  void Write(Writer &&that) {
+    // no flush until all of them are appended, which would free the copies
+    for (const auto &range: that.ranges) {
+      auto first = static_cast<char const *>(range.iov_base);
+      Append(first, first + range.iov_len);
+    }
+    for (auto &block: that.blocks)
+      blocks.push_back(std::move(block));
+    block_used = kBlockSize;
+    that.ranges.clear();
+    that.blocks.clear();
+    that.size = 0;
+    if (fd != -1 && (ranges.size() >= kMaxRanges || size >= kMaxSize))
+      Flush();
+  }
+
+  void Flush() {
+    auto pos = ranges.data();
+    auto last = ranges.data() + ranges.size();
+    while (pos != last) {
+      auto n = writev(fd, pos, std::min<std::size_t>(last - pos, kMaxRanges));
+      if (n == -1 && errno == EINTR) continue;
+      if (n == -1)
+        HandleError("Failed to write: " + std::string(strerror(errno)));
+      // skip over what has been written, which may end mid range
+      for (; pos != last && static_cast<std::size_t>(n) >= pos->iov_len; ++pos)
+        n -= pos->iov_len;
+      if (pos != last) {
+        pos->iov_base = static_cast<char *>(pos->iov_base) + n;
+        pos->iov_len -= n;
+      }
+    }
+    ranges.clear();
+    blocks.clear();
+    block_used = kBlockSize;
+    size = 0;
+  }
+
+  // same as Write, but never flushes
+  void Append(char const *first, char const *last) {
+    if (first == last) return;
+    if (!ranges.empty()) {
+      auto &prev = ranges.back();
+      if (static_cast<char const *>(prev.iov_base) + prev.iov_len == first) {
+        prev.iov_len += last - first;
+        size += last - first;
+        return;
+      }
+    }
+    ranges.push_back({const_cast<char *>(first),
+                      static_cast<std::size_t>(last - first)});
+    size += last - first;
+  }
+};
+
+constexpr std::size_t Writer::kMaxRanges;
+constexpr std::size_t Writer::kMaxSize;
+constexpr std::size_t Writer::kBlockSize;
+
 /**
  * Simple class that is similar to std::string_view
  * Also supports simple matching / comparison functionalities
@@ -127,237 +536,2775 @@ struct StringBlock {
   }
 };
 
+/**
+ * Number at the beginning of a string as compared by `sort -n`, i.e.,
+ * optional blanks, an optional '-', digits and an optional fraction
+ * A string that does not begin with a number is zero
+ *
+ * The digits are compared as strings rather than converted,
+ * so there is neither allocation nor overflow
+ */
+struct Decimal {
+  bool negative = false;
+  StringBlock integer;  // without leading zeros
+  StringBlock fraction; // without trailing zeros
+
+  explicit Decimal(StringBlock const &s)
+      : integer(s.first, s.first), fraction(s.first, s.first) {
+    const auto IsDigit = [](char c) { return c >= '0' && c <= '9'; };
+    auto pos = s.first;
+    while (pos < s.last && (*pos == ' ' || *pos == '\t')) ++pos;
+    if (pos < s.last && *pos == '-') negative = true, ++pos;
+    while (pos < s.last && *pos == '0') ++pos;
+    auto first = pos;
+    while (pos < s.last && IsDigit(*pos)) ++pos;
+    integer = StringBlock{first, pos};
+    if (pos < s.last && *pos == '.') {
+      first = ++pos;
+      while (pos < s.last && IsDigit(*pos)) ++pos;
+      while (pos > first && pos[-1] == '0') --pos;
+      fraction = StringBlock{first, pos};
+    }
+    // -0 is 0
+    if (integer.Distance() == 0 && fraction.Distance() == 0) negative = false;
+  }
+
+  // same convention as StringBlock::Compare
+  long Compare(Decimal const &that) const noexcept {
+    if (negative != that.negative) return negative ? 1 : -1;
+    const auto Identity = [](char c) { return c; };
+    long cmp = that.integer.Distance() - integer.Distance();
+    if (cmp == 0) cmp = integer.Compare(that.integer, Identity);
+    if (cmp == 0) cmp = fraction.Compare(that.fraction, Identity);
+    return negative ? -cmp : cmp;
+  }
+};
+
+constexpr int Config::kMaxKeyColumns;
 
 /**
- * Same as std::find_if, except:
- * - predicate takes the iterator itself as the argument
+ * Key columns of a row in the order of -k, or a search key split into
+ * its columns, which are compared column by column
+ *
+ * With -g, the floating point value of each column is parsed once along
+ * with the key, rather than upon every comparison. Text that is not
+ * a number is NaN
  */
-template<typename It, typename F>
-It FindIf(It first, It last, F pred) {
-  for (; first != last; ++first)
-    if (pred(first)) break;
-  return first;
-}
+struct Key {
+  int size = 0;
+  std::array<char const *, Config::kMaxKeyColumns> firsts{};
+  std::array<char const *, Config::kMaxKeyColumns> lasts{};
+  std::array<double, Config::kMaxKeyColumns> numbers{};
+
+  StringBlock Column(int i) const noexcept {
+    return StringBlock{firsts[i], lasts[i]};
+  }
+
+  friend std::ostream &operator<<(std::ostream &os, const Key &key) {
+    for (int i = 0; i < key.size; ++i)
+      os << (i ? " | " : "") << key.Column(i);
+    return os;
+  }
+
+  // parse the number at the beginning of the text as strtod does,
+  // from a copy on the stack since the text is not null terminated
+  static double ParseNumber(StringBlock const &text) {
+    char buffer[64];
+    auto n = std::min<std::ptrdiff_t>(text.Distance(), sizeof(buffer) - 1);
+    std::memcpy(buffer, text.first, n);
+    buffer[n] = '\0';
+    char *end;
+    auto number = std::strtod(buffer, &end);
+    return end == buffer ? std::numeric_limits<double>::quiet_NaN() : number;
+  }
+};
+
 
 /**
- * Performs binary search on the sorted file to find match to the given key
+ * Layout of the rows and the key of the sorted file, as recorded by the
+ * files created from it, which must be searched with the same layout
  */
-void Run(Config const &config, std::string const &key) {
-  if (config.first == config.last) return;
-  StringBlock search_key{key};
+struct KeyLayout {
+  uint64_t record_size;
+  uint64_t key_offset;
+  uint64_t key_len;
+  char col_sep;
+  char row_sep;
+  uint8_t cols[Config::kMaxKeyColumns];
+  char reserved[2];
 
-  auto lb = config.first;
-  auto ub = config.last;
+  static KeyLayout Of(Config const &config) {
+    KeyLayout layout{};
+    layout.record_size = config.record_size;
+    layout.key_offset = config.key_offset;
+    layout.key_len = config.key_len;
+    layout.col_sep = config.col_sep;
+    layout.row_sep = config.row_sep;
+    std::memcpy(layout.cols, config.cols.data(), sizeof(layout.cols));
+    return layout;
+  }
 
-  // search backward and return the starting position of the current row
-  // and store starting positions of columns within the row
-  std::deque<char const *> col_pos;
-  const auto FindRowBegin = [&col_pos, &config](auto pos, auto lb) {
-    auto first = FindIf(std::make_reverse_iterator(pos),
-                        std::make_reverse_iterator(lb),
-                        [&col_pos, &config](auto pos) {
-                          if (*pos == config.row_sep) return true;
-                          if (*pos == config.col_sep)
-                            col_pos.push_front(pos.base());
-                          return false;
-                        }).base();
-    col_pos.push_front(first);
-    return first;
-  };
+  bool Matches(Config const &config) const {
+    return record_size == config.record_size
+        && key_offset == config.key_offset && key_len == config.key_len
+        && col_sep == config.col_sep && row_sep == config.row_sep
+        && std::memcmp(cols, config.cols.data(), sizeof(cols)) == 0;
+  }
+};
 
-  // search forward and return the last position of the current row
-  // and store starting positions of columns
-  const auto FindRowEnd = [&col_pos, &config](auto pos, auto ub) {
-    auto last = FindIf(pos, ub, [&col_pos, &config](auto pos) {
-      if (*pos == config.row_sep) return true;
-      if (*pos == config.col_sep)
-        col_pos.push_back(pos + 1);
-      return false;
-    });
-    col_pos.push_back(last + 1);
-    return last;
+/**
+ * Sparse index of the sorted file, created by the index command
+ *
+ * Holds the offset and the key column of the first row of every block
+ * of the file, so that a search bisects the index in memory first
+ * and then only a single block of the file
+ *
+ * File layout, in native byte order:
+ *   Header
+ *   uint64_t offsets[count]: row offsets within the file
+ *   uint64_t keys[count + 1]: key column offsets within blob
+ *   char blob[]: key columns concatenated
+ */
+struct SparseIndex {
+  static constexpr char kMagic[8] = {'B', 'S', 'Q', 'I', 'D', 'X', '3', 0};
+
+  struct Header {
+    char magic[8];
+    uint64_t file_size;
+    uint64_t block_size;
+    uint64_t count;
+    FileStamp stamp;
+    KeyLayout layout;
   };
 
-  const auto GetColumn = [&col_pos, &config](auto first, auto last) {
-    if (col_pos.size() < config.col + 1)
-      HandleError("Not enough columns\n" + std::string(first, last));
-    return StringBlock{col_pos[config.col - 1], col_pos[config.col] - 1};
+  uint64_t count = 0;
+  uint64_t const *offsets = nullptr;
+  uint64_t const *keys = nullptr;
+  char const *blob = nullptr;
+
+  /**
+   * Interprets the mmap of an index file created for the given config
+   */
+  SparseIndex(Config const &config, MappedFile const &file) {
+    Header header;
+    if (file.Size() < sizeof(header))
+      HandleError("Invalid index: too small");
+    std::memcpy(&header, file.first, sizeof(header));
+    if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0)
+      HandleError("Invalid index: bad magic");
+    if (header.file_size != static_cast<uint64_t>(config.last - config.first))
+      HandleError("Index is stale: file size has changed");
+    if (header.stamp != config.stamp)
+      HandleError("Index is stale: file has been modified or replaced");
+    if (!header.layout.Matches(config))
+      HandleError("Index was created with a different -t, -k, --record-size,"
+                  " --key-offset or --key-len option");
+
+    count = header.count;
+    offsets = reinterpret_cast<uint64_t const *>(file.first + sizeof(header));
+    keys = offsets + count;
+    blob = reinterpret_cast<char const *>(keys + count + 1);
+    if (blob > file.last || blob + keys[count] > file.last)
+      HandleError("Invalid index: truncated");
+  }
+
+  StringBlock Key(uint64_t i) const noexcept {
+    return StringBlock{blob + keys[i], blob + keys[i + 1]};
+  }
+
+  /**
+   * Narrows down [lb, ub) to the block that contains the lower bound
+   * of the search key, i.e., between the last entry whose key column is
+   * less than the key and the next entry
+   *
+   * compare: same ordering as StringBlock::Compare
+   */
+  template<typename K, typename F>
+  void Narrow(K const &key, char const *&lb, char const *&ub,
+              F compare) const {
+    auto base = lb;
+    uint64_t lo = 0;
+    uint64_t hi = count;
+    while (lo < hi) {
+      auto mid = lo + (hi - lo) / 2;
+      if (compare(key, Key(mid)) >= 0) hi = mid;
+      else lo = mid + 1;
+    }
+    if (lo > 0) lb = base + offsets[lo - 1];
+    if (lo < count) ub = base + offsets[lo];
+  }
+};
+
+constexpr char SparseIndex::kMagic[8];
+
+/**
+ * Packed index of the sorted file, created by the index command with
+ * --eytzinger
+ *
+ * Holds the first 8 bytes of the first key column of the first row of
+ * every block, packed into an integer that orders the same way as the
+ * column, along with the offset of the row. The entries are laid out in
+ * Eytzinger order, i.e., the BFS order of a complete binary search tree,
+ * so that the search walks down the tree with branch-free comparisons
+ * and reads ahead the entries of the levels below, which are contiguous
+ *
+ * File layout, in native byte order:
+ *   Header
+ *   uint64_t prefixes[count + 1]: key prefixes from index 1 in BFS order
+ *   uint64_t offsets[count + 1]: row offsets within the file, same order
+ */
+struct EytzingerIndex {
+  static constexpr char kMagic[8] = {'B', 'S', 'Q', 'E', 'Y', 'T', '3', 0};
+  // levels of the tree read ahead by the walk, i.e., 16 entries
+  static constexpr int kPrefetchLevels = 4;
+
+  // 128 bytes, so that the entries of each level below are cache aligned
+  struct Header {
+    char magic[8];
+    uint64_t file_size;
+    uint64_t block_size;
+    uint64_t count;
+    FileStamp stamp;
+    KeyLayout layout;
+    uint8_t fold;
+    char reserved[47];
   };
 
-  const auto Compare =
-      [&config](StringBlock const &a, StringBlock const &b) noexcept {
-        if (config.fold)
-          return a.Compare(b, [](auto c) { return std::toupper(c); });
-        else
-          return a.Compare(b, [](auto c) { return c; });
-      };
-
-  const auto IsPrefixOf =
-      [&config](StringBlock const &a, StringBlock const &b) noexcept {
-        if (config.fold)
-          return a.IsPrefixOf(b, [](auto c) { return std::toupper(c); });
-        else
-          return a.IsPrefixOf(b, [](auto c) { return c; });
-      };
-
-  if (config.check) {
-    StringBlock prev{lb, lb}; // empty
-    while (lb < ub) {
-      col_pos.clear();
-      col_pos.push_back(lb);
-      auto first = lb;
-      auto last = FindRowEnd(lb, ub);
-      auto column = GetColumn(first, last);
-      if (Compare(prev, column) < 0)
-        HandleError("Unordered at row:\n" + std::string(first, last));
+  uint64_t count = 0;
+  uint64_t const *prefixes = nullptr;
+  uint64_t const *offsets = nullptr;
+
+  static bool IsEytzingerIndex(MappedFile const &file) {
+    return file.Size() >= sizeof(kMagic)
+        && std::memcmp(file.first, kMagic, sizeof(kMagic)) == 0;
+  }
+
+  /**
+   * Interprets the mmap of an index file created for the given config
+   */
+  EytzingerIndex(Config const &config, MappedFile const &file) {
+    Header header;
+    if (file.Size() < sizeof(header))
+      HandleError("Invalid index: too small");
+    std::memcpy(&header, file.first, sizeof(header));
+    if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0)
+      HandleError("Invalid index: bad magic");
+    if (header.file_size != static_cast<uint64_t>(config.last - config.first))
+      HandleError("Index is stale: file size has changed");
+    if (header.stamp != config.stamp)
+      HandleError("Index is stale: file has been modified or replaced");
+    if (!header.layout.Matches(config) || header.fold != config.fold)
+      HandleError("Index was created with a different -t, -k, -f,"
+                  " --record-size, --key-offset or --key-len option");
+    if (config.order != Config::Order::kBytes)
+      HandleError("The --eytzinger index cannot be used with -n or -g");
+
+    count = header.count;
+    prefixes = reinterpret_cast<uint64_t const *>(file.first + sizeof(header));
+    offsets = prefixes + count + 1;
+    if (reinterpret_cast<char const *>(offsets + count + 1) > file.last)
+      HandleError("Invalid index: truncated");
+  }
 
-      lb = last + 1;
-      prev = column;
+  /**
+   * Packs up to the first 8 chars of the column into an integer, the first
+   * char being the most significant byte, so that the integers order the
+   * same way as the columns do, except that columns that share the prefix,
+   * or only differ in trailing CHAR_MIN chars, may be equal
+   */
+  static uint64_t Prefix(StringBlock const &column, bool fold) {
+    uint64_t prefix = 0;
+    auto pos = column.first;
+    for (int i = 0; i < 8; ++i) {
+      // 0 is also the end of the column, which is less than any char
+      uint64_t c = pos < column.last
+          ? (fold ? std::toupper(*pos) : *pos) - CHAR_MIN : 0;
+      prefix = prefix << 8 | c;
+      if (pos < column.last) ++pos;
     }
-    return;
+    return prefix;
   }
 
-  // binary search loop.
-  // at the end of the search, lb points to the first row's first pos
-  // whose key column is lexicographically geq to the given search key
-  //
-  // complexity: ~ O( M * log2(N) )
-  // where N is # of rows and M is avg length of a row; file size is thus M*N
-  while (lb < ub) {
-    col_pos.clear();
-    auto pos = lb + (ub - lb) / 2;
-    auto first = FindRowBegin(pos, lb);
-    auto last = FindRowEnd(pos, ub);
-    auto column = GetColumn(first, last);
-#ifndef NDEBUG
-    std::cerr << "*** " << StringBlock{first, last} << "\n";
-    std::cerr << "*** " << column << "\n\n";
-#endif // NDEBUG
+  // walk down the tree to the leaf, going right while before(prefix) holds.
+  // the bits of the result below its leading one are the turns taken,
+  // where 1 is right
+  template<typename F>
+  uint64_t Walk(F before) const {
+    uint64_t k = 1;
+    while (k <= count) {
+      // the 16 entries 4 levels below k are contiguous
+      __builtin_prefetch(prefixes + (k << kPrefetchLevels));
+      __builtin_prefetch(prefixes + (k << kPrefetchLevels) + 8);
+      k = 2 * k + before(prefixes[k]);
+    }
+    return k;
+  }
 
-    if (Compare(search_key, column) >= 0) ub = first;
-    else lb = last + 1;
+  /**
+   * Narrows down [lb, ub) of the file that begins at first to the rows
+   * between the last entry whose prefix is less than that of the column,
+   * and the first entry whose prefix is greater. Since the prefixes order
+   * the same way as the columns, the lower bound of any key whose first
+   * column is the given one lies within them
+   */
+  void Narrow(StringBlock const &column, char const *first,
+              char const *&lb, char const *&ub, bool fold) const {
+    auto prefix = Prefix(column, fold);
+    // the last node at which the walk turned right is the last entry less
+    // than the prefix, whereas the last one at which it turned left is the
+    // first entry not less (or, for the second walk, greater) than it
+    auto k = Walk([prefix](uint64_t p) { return p < prefix; });
+    auto lo = k >> __builtin_ffsll(k);
+    k = Walk([prefix](uint64_t p) { return p <= prefix; });
+    auto hi = k >> __builtin_ffsll(~k);
+    if (lo > 0) lb = std::max(lb, first + offsets[lo]);
+    if (hi > 0) ub = std::min(ub, first + offsets[hi]);
   }
 
-  const auto IsExactMatch = [&Compare](const auto &key, const auto &col) {
-    return Compare(key, col) == 0;
-  };
-  const auto IsPrefixMatch = [&IsPrefixOf](const auto &key, const auto &col) {
-    return IsPrefixOf(key, col);
+  /**
+   * Writes the index of the given entries, in sorted order, to the stream
+   */
+  static void Write(std::ostream &os, Header header,
+                    std::vector<uint64_t> const &sorted_prefixes,
+                    std::vector<uint64_t> const &sorted_offsets) {
+    const auto n = sorted_prefixes.size();
+    std::vector<uint64_t> prefixes(n + 1, 0);
+    std::vector<uint64_t> offsets(n + 1, 0);
+    // an in-order traversal of the tree visits the entries in sorted order
+    std::size_t i = 0;
+    const auto Visit = [&](std::size_t k, auto &visit) -> void {
+      if (k > n) return;
+      visit(2 * k, visit);
+      prefixes[k] = sorted_prefixes[i];
+      offsets[k] = sorted_offsets[i++];
+      visit(2 * k + 1, visit);
+    };
+    Visit(1, Visit);
+
+    std::memcpy(header.magic, kMagic, sizeof(header.magic));
+    header.count = n;
+    os.write(reinterpret_cast<char const *>(&header), sizeof(header));
+    os.write(reinterpret_cast<char const *>(prefixes.data()),
+             prefixes.size() * sizeof(uint64_t));
+    os.write(reinterpret_cast<char const *>(offsets.data()),
+             offsets.size() * sizeof(uint64_t));
+  }
+};
+
+constexpr char EytzingerIndex::kMagic[8];
+static_assert(sizeof(EytzingerIndex::Header) == 128, "cache aligned entries");
+constexpr int EytzingerIndex::kPrefetchLevels;
+
+/**
+ * Database compressed block by block, created by the compress command
+ *
+ * The file is split into blocks of whole rows, each compressed on its own
+ * with zlib, so that a search decompresses only the blocks it touches.
+ * The key columns of the first rows of the blocks are kept uncompressed,
+ * same as SparseIndex, to find the block of a key in memory. The most
+ * recently used blocks are kept decompressed in a small cache
+ *
+ * File layout, in native byte order:
+ *   Header
+ *   char data[]: compressed blocks concatenated
+ *   uint64_t offsets[count + 1]: offsets of the blocks within the original
+ *     file, followed by its size
+ *   uint64_t data_offsets[count + 1]: offsets of the compressed blocks
+ *     within the compressed file, followed by the end of the last one
+ *   uint64_t keys[count + 1]: key column offsets within blob
+ *   char blob[]: key columns concatenated
+ */
+struct CompressedFile {
+  static constexpr char kMagic[8] = {'B', 'S', 'Q', 'Z', 'I', 'P', '2', 0};
+  // decompressed blocks kept in the cache
+  static constexpr std::size_t kCacheSize = 16;
+
+  struct Header {
+    char magic[8];
+    uint64_t file_size;
+    uint64_t block_size;
+    uint64_t count;
+    uint64_t table_offset;
+    KeyLayout layout;
   };
 
-  ub = config.last;
-  while (lb < ub) {
-    col_pos.clear();
-    col_pos.push_back(lb);
-    auto first = lb;
-    auto last = FindRowEnd(lb, ub);
-    auto column = GetColumn(first, last);
+  using Block = std::shared_ptr<std::string const>;
 
-    auto is_match = config.exact_match
-                    ? IsExactMatch(search_key, column)
-                    : IsPrefixMatch(search_key, column);
+  uint64_t file_size = 0;
+  uint64_t count = 0;
+  char const *data = nullptr;
+  uint64_t const *offsets = nullptr;
+  uint64_t const *data_offsets = nullptr;
+  uint64_t const *keys = nullptr;
+  char const *blob = nullptr;
+  // most recently used first
+  mutable std::vector<std::pair<uint64_t, Block>> cache;
+  mutable std::mutex mutex;
 
-    if (is_match) {
-      std::cout << StringBlock{first, last} << config.row_sep;
-      lb = last + 1;
-    } else break;
+  // whatever its version, which is checked upon opening it
+  static bool IsCompressedFile(MappedFile const &file) {
+    return file.Size() >= sizeof(kMagic)
+        && std::memcmp(file.first, kMagic, sizeof(kMagic) - 2) == 0;
   }
-}
 
-int main(int argc, const char **argv) {
-  std::vector<std::string> args;
-  args.reserve(argc);
-  for (auto it = argv; it != argv + argc; ++it)
-    args.emplace_back(*it);
+  /**
+   * Interprets the mmap of a file compressed with the given config
+   */
+  CompressedFile(Config const &config, MappedFile const &file) {
+    Header header;
+    if (file.Size() < sizeof(header))
+      HandleError("Invalid compressed file: too small");
+    std::memcpy(&header, file.first, sizeof(header));
+    if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0)
+      HandleError("Invalid compressed file: bad magic");
+    if (!header.layout.Matches(config))
+      HandleError("File was compressed with a different -t, -k,"
+                  " --record-size, --key-offset or --key-len option");
 
-  Config config;
-  std::string filename;
-  std::vector<std::string> search_keys;
-  const auto ExtractChar = [](std::string const &s) { return s.front(); };
-  const auto ExtractInt = [](std::string const &s) { return std::stoi(s); };
+    file_size = header.file_size;
+    count = header.count;
+    data = file.first;
+    if (header.table_offset > file.Size())
+      HandleError("Invalid compressed file: truncated");
+    offsets = reinterpret_cast<uint64_t const *>(file.first
+                                                 + header.table_offset);
+    data_offsets = offsets + count + 1;
+    keys = data_offsets + count + 1;
+    blob = reinterpret_cast<char const *>(keys + count + 1);
+    if (blob > file.last || blob + keys[count] > file.last)
+      HandleError("Invalid compressed file: truncated");
+  }
 
-  // parse options & arguments
-  bool read_literal = false;
-  try {
-    for (auto it = args.begin() + 1; it != args.end(); ++it) {
-      if (*it == "--") {
-        read_literal = true;
-        continue;
-      }
+  StringBlock Key(uint64_t i) const noexcept {
+    return StringBlock{blob + keys[i], blob + keys[i + 1]};
+  }
 
-      if (it->size() >= 2 && it->front() == '-' && !read_literal) {
-        switch (it->at(1)) {
-          case 'h':
-            return Usage(args.front());
-          case 'c':
-          case 'w':
-          case 'f':
-            std::for_each(it->begin() + 1, it->end(), [&config](char c) {
-              switch (c) {
-                case 'w':
-                  config.exact_match = true;
-                  break;
-                case 'c':
-                  config.check = true;
-                  break;
-                case 'f':
-                  config.fold = true;
-                  break;
-                default:
-                  HandleError("Invalid option: -" + std::string(1, c));
-              }
-            });
-            break;
-          case 't':
-            config.col_sep = ExtractArgument(it, args.end(), ExtractChar);
-            break;
-          case 'k': {
-            const auto max = std::numeric_limits<decltype(config.col)>::max();
-            auto k = ExtractArgument(it, args.end(), ExtractInt);
-            if (k > max || k < 1)
-              HandleError("N must be within [1, " + std::to_string(max) + "]");
-            config.col = k;
-          }
-            break;
-          default:
-            HandleError("Invalid argument: " + *it);
-        }
-      } else if (it->front() != '-' || read_literal) {
-        if (filename.empty()) filename = std::move(*it);
-        else search_keys.push_back(std::move(*it));
-      } else {
-        HandleError("Invalid option: " + *it);
-      }
-      read_literal = false;
+  /**
+   * Returns the block that contains the lower bound of the search key,
+   * i.e., the last block whose first key column is less than the key
+   *
+   * compare: same ordering as StringBlock::Compare
+   */
+  template<typename K, typename F>
+  uint64_t Find(K const &key, F compare) const {
+    uint64_t lo = 0;
+    uint64_t hi = count;
+    while (lo < hi) {
+      auto mid = lo + (hi - lo) / 2;
+      if (compare(key, Key(mid)) >= 0) hi = mid;
+      else lo = mid + 1;
     }
+    return lo > 0 ? lo - 1 : 0;
+  }
 
-    if (filename.empty())
-      return Usage(args.front());
-
-    // the file will be read as mmap
-    struct stat sb;
-    auto fd = open(filename.c_str(), O_RDONLY);
-    if (fd == -1) HandleError("Failed to open: " + filename);
-    if (fstat(fd, &sb) == -1) HandleError("Failed with fstat");
-    auto addr = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    if (addr == MAP_FAILED) HandleError("mmap failed: " + filename);
-    close(fd);
-    config.first = reinterpret_cast<char const *>(addr);
-    config.last = config.first + sb.st_size;
-
-    if (config.check) {
-      search_keys = {""};
-    } else if (search_keys.empty()) {
-      std::string key;
-      while (std::getline(std::cin, key, config.row_sep)) {
-        search_keys.push_back(std::move(key));
+  /**
+   * Returns the i-th block decompressed, from the cache if it is there
+   * The block stays valid as long as it is held, even once evicted
+   */
+  Block Get(uint64_t i) const {
+    {
+      std::lock_guard<std::mutex> lock{mutex};
+      auto it = std::find_if(cache.begin(), cache.end(),
+                             [i](auto const &entry) {
+                               return entry.first == i;
+                             });
+      if (it != cache.end()) {
+        std::rotate(cache.begin(), it, it + 1);
+        return cache.front().second;
       }
     }
 
-    for (const auto &key: search_keys)
-      Run(config, key);
+    // decompress outside the lock, so that the other threads may go on
+    std::string block(offsets[i + 1] - offsets[i], '\0');
+    auto size = static_cast<uLongf>(block.size());
+    auto status = uncompress(reinterpret_cast<Bytef *>(&block[0]), &size,
+                             reinterpret_cast<Bytef const *>(
+                                 data + data_offsets[i]),
+                             data_offsets[i + 1] - data_offsets[i]);
+    if (status != Z_OK || size != block.size())
+      HandleError("Invalid compressed file: corrupt block "
+                  + std::to_string(i));
+    auto result = std::make_shared<std::string const>(std::move(block));
+
+    std::lock_guard<std::mutex> lock{mutex};
+    cache.emplace(cache.begin(), i, result);
+    if (cache.size() > kCacheSize) cache.pop_back();
+    return result;
+  }
+};
+
+constexpr char CompressedFile::kMagic[8];
+constexpr std::size_t CompressedFile::kCacheSize;
 
-    munmap(addr, sb.st_size);
+/**
+ * Offsets of the first row that begins within each block of the file,
+ * given by --row-table
+ *
+ * The row of a block is found the first time the binary search lands on
+ * the block, and kept for the later probes, which then parse the row
+ * right away rather than scan backward for the beginning of one. The
+ * table is shared by all the searches, so that the blocks near the top
+ * of the search tree are found once for all the keys
+ */
+struct RowTable {
+  static constexpr uint64_t kUnknown = std::numeric_limits<uint64_t>::max();
+
+  std::size_t block_size;
+  std::size_t count;
+  // offset of the row within the file, or the file size if no row begins
+  // within the block, or kUnknown if it has not been found yet
+  std::unique_ptr<std::atomic<uint64_t>[]> rows;
+
+  RowTable(std::size_t file_size, std::size_t block_size)
+      : block_size(block_size),
+        count((file_size + block_size - 1) / block_size),
+        rows(new std::atomic<uint64_t>[count]) {
+    for (std::size_t i = 0; i < count; ++i) rows[i] = kUnknown;
+  }
+
+  /**
+   * Returns the offset of the row of the i-th block, found by find(i)
+   * unless it is already known. Threads that race on the same block
+   * find the same row, so no lock is needed
+   */
+  template<typename F>
+  uint64_t Get(std::size_t i, F find) const {
+    auto row = rows[i].load(std::memory_order_relaxed);
+    if (row == kUnknown) {
+      row = find(i);
+      rows[i].store(row, std::memory_order_relaxed);
+    }
+    return row;
+  }
+};
+
+constexpr uint64_t RowTable::kUnknown;
+
+/**
+ * Blocked Bloom filter of the keys of the sorted file, created by the
+ * index command with --bloom
+ *
+ * All the bits of a key are set within a single block of a cache line,
+ * so that a key is told to be absent from the file by reading one cache
+ * line of the filter, without touching the file at all. Only the exact
+ * match of -w can be ruled out this way, as the filter knows nothing of
+ * the prefixes of the keys
+ *
+ * File layout, in native byte order:
+ *   Header
+ *   uint64_t blocks[num_blocks][kBlockBits / 64]: bits of the filter
+ */
+struct BloomFilter {
+  static constexpr char kMagic[8] = {'B', 'S', 'Q', 'B', 'L', 'M', '3', 0};
+  // bits of each block, i.e., a cache line
+  static constexpr uint32_t kBlockBits = 512;
+  static constexpr uint32_t kMaxHashes = 16;
+
+  // 128 bytes, so that the blocks are cache aligned
+  struct Header {
+    char magic[8];
+    uint64_t file_size;
+    uint64_t count;
+    uint64_t num_blocks;
+    FileStamp stamp;
+    KeyLayout layout;
+    uint32_t num_hashes;
+    uint8_t fold;
+    char reserved[43];
+  };
+
+  uint64_t num_blocks = 0;
+  uint32_t num_hashes = 0;
+  char col_sep;
+  bool fold;
+  uint64_t const *blocks = nullptr;
+
+  static bool IsBloomFilter(MappedFile const &file) {
+    return file.Size() >= sizeof(kMagic)
+        && std::memcmp(file.first, kMagic, sizeof(kMagic)) == 0;
+  }
+
+  /**
+   * Interprets the mmap of a filter file created for the given config
+   */
+  BloomFilter(Config const &config, MappedFile const &file)
+      : col_sep(config.col_sep), fold(config.fold) {
+    Header header;
+    if (file.Size() < sizeof(header))
+      HandleError("Invalid filter: too small");
+    std::memcpy(&header, file.first, sizeof(header));
+    if (header.file_size != static_cast<uint64_t>(config.last - config.first))
+      HandleError("Filter is stale: file size has changed");
+    if (header.stamp != config.stamp)
+      HandleError("Filter is stale: file has been modified or replaced");
+    if (!header.layout.Matches(config) || header.fold != config.fold)
+      HandleError("Filter was created with a different -t, -k, -f,"
+                  " --record-size, --key-offset or --key-len option");
+    if (config.order != Config::Order::kBytes)
+      HandleError("The --bloom filter cannot be used with -n or -g");
+
+    num_blocks = header.num_blocks;
+    num_hashes = header.num_hashes;
+    blocks = reinterpret_cast<uint64_t const *>(file.first + sizeof(header));
+    if (num_blocks == 0 || num_hashes == 0 || num_hashes > kMaxHashes
+        || reinterpret_cast<char const *>(blocks + num_blocks * kBlockBits / 64)
+            > file.last)
+      HandleError("Invalid filter: truncated");
+  }
+
+  // murmur3 finalizer
+  static uint64_t Mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+  }
+
+  /**
+   * Hashes the key columns delimited by col_sep, i.e., the text of the
+   * search key, folded to upper case if fold
+   */
+  static uint64_t Hash(Key const &key, char col_sep, bool fold) {
+    // FNV-1a, whose weak low bits are mixed in at the end
+    uint64_t h = 0xcbf29ce484222325ULL;
+    const auto Add = [&h](char c) {
+      h = (h ^ static_cast<unsigned char>(c)) * 0x100000001b3ULL;
+    };
+    for (int i = 0; i < key.size; ++i) {
+      if (i) Add(col_sep);
+      for (auto pos = key.firsts[i]; pos < key.lasts[i]; ++pos)
+        Add(fold ? std::toupper(*pos) : *pos);
+    }
+    return Mix(h);
+  }
+
+  /**
+   * Calls f(word, mask) for each of the num_hashes bits of the hash,
+   * all of which lie within the block given by the hash
+   */
+  template<typename F>
+  static void ForEachBit(uint64_t hash, uint64_t num_blocks,
+                         uint32_t num_hashes, F f) {
+    auto block = static_cast<uint64_t>(
+        (static_cast<unsigned __int128>(hash) * num_blocks) >> 64);
+    // each bit within the block takes 9 bits of a stream of hashes that
+    // are independent of the block. double hashing would be cheaper, but
+    // leaves too few combinations of bits within a block for low rates
+    uint64_t seed = hash;
+    uint64_t h = 0;
+    for (uint32_t i = 0; i < num_hashes; ++i) {
+      if (i % 7 == 0) h = seed = Mix(seed ^ 0x9e3779b97f4a7c15ULL);
+      auto bit = static_cast<uint32_t>(h % kBlockBits);
+      h /= kBlockBits;
+      f(block * kBlockBits / 64 + bit / 64, uint64_t{1} << bit % 64);
+    }
+  }
+
+  /**
+   * Estimates the false positive rate of the filter with keys_per_block
+   * keys in each block on average. The keys are not spread evenly over
+   * the blocks, but as Poisson, and the crowded blocks raise the rate
+   * above that of the standard Bloom filter
+   */
+  static double EstimateRate(double keys_per_block, uint32_t num_hashes) {
+    double rate = 0;
+    auto p = std::exp(-keys_per_block);
+    for (int j = 0; j < keys_per_block * 2 + 64; ++j) {
+      auto unset = std::pow(1.0 - 1.0 / kBlockBits, j * num_hashes);
+      rate += p * std::pow(1 - unset, num_hashes);
+      p *= keys_per_block / (j + 1);
+    }
+    return rate;
+  }
+
+  // false if no row has the key, or true if some row may have it
+  bool MayContain(Key const &key) const {
+    auto result = true;
+    ForEachBit(Hash(key, col_sep, fold), num_blocks, num_hashes,
+               [this, &result](uint64_t word, uint64_t mask) {
+                 result &= (blocks[word] & mask) != 0;
+               });
+    return result;
+  }
+};
+
+constexpr char BloomFilter::kMagic[8];
+static_assert(sizeof(BloomFilter::Header) == 128, "cache aligned blocks");
+constexpr uint32_t BloomFilter::kBlockBits;
+constexpr uint32_t BloomFilter::kMaxHashes;
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BSQ_X86_SIMD
+#include <immintrin.h>
+#endif
+
+#ifdef BSQ_X86_SIMD
+/**
+ * Instruction sets to scan for separators with, detected once at runtime
+ */
+struct CpuFeatures {
+  bool avx2 = false;
+  bool sse2 = false;
+
+  CpuFeatures() {
+    __builtin_cpu_init();
+    avx2 = __builtin_cpu_supports("avx2");
+    sse2 = __builtin_cpu_supports("sse2");
+  }
+};
+
+CpuFeatures const &GetCpuFeatures() {
+  static const CpuFeatures features;
+  return features;
+}
+#endif // BSQ_X86_SIMD
+
+/**
+ * Scans [first, last) forward and calls pred(pos) for each pos
+ * such that *pos is either a or b, until pred returns true
+ *
+ * Returns the pos on which pred returned true, or last if none did
+ */
+template<typename F>
+char const *ScanForwardScalar(char const *first, char const *last,
+                              char a, char b, F &pred) {
+  for (; first != last; ++first)
+    if ((*first == a || *first == b) && pred(first)) break;
+  return first;
+}
+
+/**
+ * Same as ScanForwardScalar, except that [first, last) is scanned backward
+ *
+ * Returns the position just after the pos on which pred returned true,
+ * or first if none did, i.e., the base of the reverse iterator
+ */
+template<typename F>
+char const *ScanBackwardScalar(char const *first, char const *last,
+                               char a, char b, F &pred) {
+  for (; last != first; --last)
+    if ((last[-1] == a || last[-1] == b) && pred(last - 1)) break;
+  return last;
+}
+
+#ifdef BSQ_X86_SIMD
+// The SIMD versions compare a chunk of 32 (AVX2) or 16 (SSE2) bytes
+// against both separators at once and then visit the set bits of the mask,
+// so that a chunk without any separator costs a single branch
+
+template<typename F>
+__attribute__((target("avx2")))
+char const *ScanForwardAvx2(char const *first, char const *last,
+                            char a, char b, F &pred) {
+  const auto va = _mm256_set1_epi8(a);
+  const auto vb = _mm256_set1_epi8(b);
+  for (; last - first >= 32; first += 32) {
+    auto v = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(first));
+    uint32_t mask = _mm256_movemask_epi8(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)));
+    for (; mask; mask &= mask - 1) {
+      auto pos = first + __builtin_ctz(mask);
+      if (pred(pos)) return pos;
+    }
+  }
+  return ScanForwardScalar(first, last, a, b, pred);
+}
+
+template<typename F>
+__attribute__((target("avx2")))
+char const *ScanBackwardAvx2(char const *first, char const *last,
+                             char a, char b, F &pred) {
+  const auto va = _mm256_set1_epi8(a);
+  const auto vb = _mm256_set1_epi8(b);
+  for (; last - first >= 32; last -= 32) {
+    auto v = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(last - 32));
+    uint32_t mask = _mm256_movemask_epi8(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)));
+    for (; mask; mask &= ~(1u << (31 - __builtin_clz(mask)))) {
+      auto pos = last - 32 + (31 - __builtin_clz(mask));
+      if (pred(pos)) return pos + 1;
+    }
+  }
+  return ScanBackwardScalar(first, last, a, b, pred);
+}
+
+template<typename F>
+__attribute__((target("sse2")))
+char const *ScanForwardSse2(char const *first, char const *last,
+                            char a, char b, F &pred) {
+  const auto va = _mm_set1_epi8(a);
+  const auto vb = _mm_set1_epi8(b);
+  for (; last - first >= 16; first += 16) {
+    auto v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(first));
+    uint32_t mask = _mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+    for (; mask; mask &= mask - 1) {
+      auto pos = first + __builtin_ctz(mask);
+      if (pred(pos)) return pos;
+    }
+  }
+  return ScanForwardScalar(first, last, a, b, pred);
+}
+
+template<typename F>
+__attribute__((target("sse2")))
+char const *ScanBackwardSse2(char const *first, char const *last,
+                             char a, char b, F &pred) {
+  const auto va = _mm_set1_epi8(a);
+  const auto vb = _mm_set1_epi8(b);
+  for (; last - first >= 16; last -= 16) {
+    auto v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(last - 16));
+    uint32_t mask = _mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+    for (; mask; mask &= ~(1u << (31 - __builtin_clz(mask)))) {
+      auto pos = last - 16 + (31 - __builtin_clz(mask));
+      if (pred(pos)) return pos + 1;
+    }
+  }
+  return ScanBackwardScalar(first, last, a, b, pred);
+}
+#endif // BSQ_X86_SIMD
+
+/**
+ * Same as ScanForwardScalar, but dispatched to the widest SIMD implementation
+ * that the CPU supports
+ */
+template<typename F>
+char const *ScanForward(char const *first, char const *last,
+                        char a, char b, F pred) {
+#ifdef BSQ_X86_SIMD
+  auto const &cpu = GetCpuFeatures();
+  if (cpu.avx2) return ScanForwardAvx2(first, last, a, b, pred);
+  if (cpu.sse2) return ScanForwardSse2(first, last, a, b, pred);
+#endif // BSQ_X86_SIMD
+  return ScanForwardScalar(first, last, a, b, pred);
+}
+
+/**
+ * Same as ScanBackwardScalar, but dispatched to the widest SIMD implementation
+ * that the CPU supports
+ */
+template<typename F>
+char const *ScanBackward(char const *first, char const *last,
+                         char a, char b, F pred) {
+#ifdef BSQ_X86_SIMD
+  auto const &cpu = GetCpuFeatures();
+  if (cpu.avx2) return ScanBackwardAvx2(first, last, a, b, pred);
+  if (cpu.sse2) return ScanBackwardSse2(first, last, a, b, pred);
+#endif // BSQ_X86_SIMD
+  return ScanBackwardScalar(first, last, a, b, pred);
+}
+
+/**
+ * Row of the file along with its key column
+ */
+struct Row {
+  char const *first; // first pos of the row
+  char const *last;  // row_sep that ends the row, or the end of the file
+  Key key;
+};
+
+/**
+ * Locates rows and their key column within the mmap'ed file
+ * and compares them against search keys as specified by the config
+ */
+struct Searcher {
+  // matching ranges of at least this size are read ahead
+  static constexpr std::ptrdiff_t kReadaheadSize = 1 << 16;
+  // midpoints of ranges of at least this size are read ahead from the file
+  static constexpr std::ptrdiff_t kPrefetchDistance = 1 << 14;
+
+  Config const &config;
+  // the last of the key columns within a row
+  int last_col;
+  // the last of the columns to print within a row
+  int last_output_col;
+
+  explicit Searcher(Config const &config)
+      : config(config),
+        last_col(*std::max_element(config.cols.begin(),
+                                   config.cols.begin() + config.num_cols)),
+        last_output_col(config.output_cols.empty()
+                        ? 0 : *std::max_element(config.output_cols.begin(),
+                                                config.output_cols.end())) {}
+
+  // search backward and return the starting position of the current row
+  char const *FindRowBegin(char const *pos, char const *lb) const {
+    if (config.record_size) return RecordAt(pos, 0);
+    return ScanBackward(lb, pos, config.row_sep, config.row_sep,
+                        [](char const *) { return true; });
+  }
+
+  // search forward and return the last position of the current row
+  char const *FindRowEnd(char const *pos, char const *ub) const {
+    if (config.record_size) return std::min(RecordAt(pos, 1) - 1, ub);
+    return ScanForward(pos, ub, config.row_sep, config.row_sep,
+                       [](char const *) { return true; });
+  }
+
+  // return the beginning of the first row at or after pos, or ub if none
+  char const *FindNextRow(char const *pos, char const *ub) const {
+    if (config.record_size)
+      return std::min(RecordAt(pos + config.record_size - 1, 0), ub);
+    if (pos == config.first) return pos;
+    auto sep = reinterpret_cast<char const *>(
+        std::memchr(pos - 1, config.row_sep, ub - pos + 1));
+    return sep ? sep + 1 : ub;
+  }
+
+  // return the beginning of the record that contains pos, or of the one
+  // offset records after it, which is found with no separator to scan
+  char const *RecordAt(char const *pos, std::ptrdiff_t offset) const {
+    auto index = (pos - config.first) / config.record_size + offset;
+    return config.first + index * config.record_size;
+  }
+
+  // parse the row that begins at first, locating only the key columns.
+  // separators are no longer inspected once the end of the last key column
+  // is found, and the rest of the row is skipped with a row_sep only scan
+  Row ParseRow(char const *first, char const *ub) const {
+    if (config.record_size) return ParseRecord(first);
+    Key key;
+    auto pos = ParseColumns(first, ub, key);
+    auto last = pos;
+    if (pos != ub && *pos != config.row_sep) last = FindRowEnd(pos, ub);
+    ParseNumbers(key);
+    return Row{first, last, key};
+  }
+
+  // parse the fixed-size record that begins at first, whose key is either
+  // the bytes at the key offset or the key columns within the record.
+  // the last byte of the record stands for its row_sep
+  Row ParseRecord(char const *first) const {
+    Row row{first, first + config.record_size - 1, Key{}};
+    if (config.key_len) {
+      row.key.size = 1;
+      row.key.firsts[0] = first + config.key_offset;
+      row.key.lasts[0] = first + config.key_offset + config.key_len;
+    } else {
+      // a row_sep within the record is data, but not one that ends it
+      auto last = first + config.record_size;
+      if (last[-1] == config.row_sep) --last;
+      ParseColumns(first, last, row.key);
+    }
+    ParseNumbers(row.key);
+    return row;
+  }
+
+  // locate the key columns of the row that begins at first, and return
+  // the end of the last of them, i.e., its separator or ub.
+  // a record ends only at ub, so only col_sep is looked for within it
+  char const *ParseColumns(char const *first, char const *ub, Key &key) const {
+    auto row_sep = config.record_size ? config.col_sep : config.row_sep;
+    auto col_first = first;
+    int col = 1;
+    // record the column that ends at pos if it is a key column
+    const auto EndColumn = [this, &key, &col_first, &col](char const *pos) {
+      for (int i = 0; i < config.num_cols; ++i) {
+        if (config.cols[i] != col) continue;
+        key.firsts[i] = col_first;
+        key.lasts[i] = pos;
+      }
+    };
+    auto pos = ScanForward(first, ub, row_sep, config.col_sep,
+                           [this, &EndColumn, &col_first, &col](
+                               char const *pos) {
+                             EndColumn(pos);
+                             if (*pos != config.col_sep || col == last_col)
+                               return true;
+                             ++col;
+                             col_first = pos + 1;
+                             return false;
+                           });
+    // the last column of the file ends without a separator
+    if (pos == ub) EndColumn(pos);
+    if (col < last_col)
+      HandleError("Not enough columns\n"
+                  + std::string(first, FindRowEnd(pos, ub)));
+    key.size = config.num_cols;
+    return pos;
+  }
+
+  // parse the row that contains pos, which lies within [lb, ub)
+  Row ParseRowAt(char const *pos, char const *lb, char const *ub) const {
+    return ParseRow(FindRowBegin(pos, lb), ub);
+  }
+
+  // read ahead the midpoints that the binary search may probe in the next
+  // depth levels after probing pos within [lb, ub), whichever half it takes.
+  // distant midpoints are read in from the file asynchronously, whereas
+  // nearby ones are only prefetched into the cache
+  void Prefetch(char const *lb, char const *pos, char const *ub,
+                int depth) const {
+    if (depth == 0 || ub - lb < 2) return;
+    auto left = lb + (pos - lb) / 2;
+    auto right = pos + (ub - pos) / 2;
+    if (ub - lb >= kPrefetchDistance) {
+      Advise(left, left + 1, MADV_WILLNEED);
+      Advise(right, right + 1, MADV_WILLNEED);
+    } else {
+      __builtin_prefetch(left);
+      __builtin_prefetch(right);
+    }
+    Prefetch(lb, left, pos, depth - 1);
+    Prefetch(pos, right, ub, depth - 1);
+  }
+
+  // parse the row at the midpoint of [lb, ub) for the binary search,
+  // or the first row of the block of the midpoint given by the row table
+  // as long as it lies within [lb, ub)
+  Row Bisect(char const *lb, char const *ub) const {
+    auto pos = lb + (ub - lb) / 2;
+    if (config.prefetch > 0) {
+      if (ub - lb >= kPrefetchDistance) Advise(pos, pos + 1, MADV_WILLNEED);
+      Prefetch(lb, pos, ub, config.prefetch);
+    }
+    if (config.row_table) {
+      auto const &table = *config.row_table;
+      auto row_first = config.first + table.Get(
+          (pos - config.first) / table.block_size, [this, &table](auto i) {
+            return FindNextRow(config.first + i * table.block_size,
+                               config.last) - config.first;
+          });
+      if (lb <= row_first && row_first < ub) return ParseRow(row_first, ub);
+    }
+    return ParseRowAt(pos, lb, ub);
+  }
+
+  // parse the numbers of the key columns for -g
+  void ParseNumbers(Key &key) const {
+    if (config.order != Config::Order::kGeneral) return;
+    for (int i = 0; i < key.size; ++i)
+      key.numbers[i] = Key::ParseNumber(key.Column(i));
+  }
+
+  // split the search key into up to as many columns as -k gives,
+  // delimited by col_sep, where the last one takes the rest of the text
+  Key MakeKey(StringBlock const &text) const {
+    Key key;
+    auto pos = text.first;
+    while (true) {
+      key.firsts[key.size] = pos;
+      if (key.size + 1 < config.num_cols)
+        pos = std::find(pos, text.last, config.col_sep);
+      else
+        pos = text.last;
+      key.lasts[key.size++] = pos;
+      if (pos == text.last) break;
+      ++pos;
+    }
+    ParseNumbers(key);
+    return key;
+  }
+
+  long CompareColumn(Key const &a, Key const &b, int i) const noexcept {
+    if (config.order == Config::Order::kNumeric)
+      return Decimal{a.Column(i)}.Compare(Decimal{b.Column(i)});
+    if (config.order == Config::Order::kGeneral) {
+      // NaN, i.e., not a number, is less than any number
+      auto a_nan = std::isnan(a.numbers[i]);
+      auto b_nan = std::isnan(b.numbers[i]);
+      if (a_nan || b_nan) return a_nan - b_nan;
+      return (a.numbers[i] < b.numbers[i]) - (a.numbers[i] > b.numbers[i]);
+    }
+    if (config.fold)
+      return a.Column(i).Compare(b.Column(i),
+                                 [](auto c) { return std::toupper(c); });
+    else
+      return a.Column(i).Compare(b.Column(i), [](auto c) { return c; });
+  }
+
+  long Compare(Key const &a, Key const &b) const noexcept {
+    auto n = std::min(a.size, b.size);
+    for (int i = 0; i < n; ++i) {
+      auto cmp = CompareColumn(a, b, i);
+      if (cmp != 0) return cmp;
+    }
+    // a search key of fewer columns precedes the rows that begin with it
+    return b.size - a.size;
+  }
+
+  bool IsPrefixOf(StringBlock const &a, StringBlock const &b) const noexcept {
+    if (config.fold)
+      return a.IsPrefixOf(b, [](auto c) { return std::toupper(c); });
+    else
+      return a.IsPrefixOf(b, [](auto c) { return c; });
+  }
+
+  // the search key matches the leading key columns of the row, where its
+  // last column may be a prefix unless -w. numbers match only if they are
+  // equal, as their prefixes mean nothing
+  bool IsMatch(Key const &key, Key const &row_key) const {
+    if (config.exact_match) return Compare(key, row_key) == 0;
+    if (key.size > row_key.size) return false;
+    auto last = key.size - 1;
+    for (int i = 0; i < last; ++i) {
+      if (CompareColumn(key, row_key, i) != 0) return false;
+    }
+    return config.order != Config::Order::kBytes
+        ? CompareColumn(key, row_key, last) == 0
+        : IsPrefixOf(key.Column(last), row_key.Column(last));
+  }
+
+  // false if the Bloom filter rules out any exact match of the key,
+  // in which case the search can be skipped
+  bool MayMatch(Key const &key) const {
+    return !config.bloom || !config.exact_match
+        || config.bloom->MayContain(key);
+  }
+
+  /**
+   * Verifies that the rows within [lb, ub) are sorted by the key column,
+   * and that the first of them is not less than the row preceding lb
+   *
+   * Returns the first row that is out of order, or nullptr if none is
+   */
+  char const *FindUnordered(char const *lb, char const *ub) const {
+    // an empty key would not precede a negative number
+    auto has_prev = lb > config.first;
+    auto prev = has_prev ? ParseRowAt(lb - 1, config.first, lb).key
+                         : MakeKey(StringBlock{lb, lb});
+    while (lb < ub) {
+      auto row = ParseRow(lb, ub);
+      if (has_prev && Compare(prev, row.key) < 0) return row.first;
+
+      lb = row.last + 1;
+      prev = row.key;
+      has_prev = true;
+    }
+    return nullptr;
+  }
+
+  // binary search loop.
+  // at the end of the search, lb points to the first row's first pos
+  // whose key column is lexicographically geq to the given search key
+  //
+  // complexity: ~ O( M * log2(N) )
+  // where N is # of rows and M is avg length of a row; file size is thus M*N
+  char const *LowerBound(Key const &search_key,
+                         char const *lb, char const *ub) {
+    if (config.interpolate) return Interpolate(search_key, lb, ub);
+    while (lb < ub) {
+      auto row = Bisect(lb, ub);
+#ifndef NDEBUG
+      std::cerr << "*** " << StringBlock{row.first, row.last} << "\n";
+      std::cerr << "*** " << row.key << "\n\n";
+#endif // NDEBUG
+
+      if (Compare(search_key, row.key) >= 0) ub = row.first;
+      else lb = row.last + 1;
+    }
+    return std::min(lb, config.last);
+  }
+
+  /**
+   * Chars that appear in the key columns seen so far, ranked by their order,
+   * e.g., 0-9a-f for hash values. Interpolating on the ranks rather than
+   * the char values keeps gaps in the alphabet from skewing the estimate
+   */
+  struct Alphabet {
+    std::array<bool, 256> seen{};
+    std::array<int, 256> rank{};
+    int size = 0;
+
+    void Add(StringBlock const &key, bool fold) {
+      auto added = false;
+      for (auto pos = key.first; pos < key.last; ++pos) {
+        auto &s = seen[Index(*pos, fold)];
+        added |= !s;
+        s = true;
+      }
+      if (!added) return;
+      size = 0;
+      for (int i = 0; i < 256; ++i)
+        if (seen[i]) rank[i] = ++size;
+    }
+
+    // order-preserving index of the char, same as Searcher::Compare
+    static int Index(char c, bool fold) {
+      return (fold ? std::toupper(c) : c) - CHAR_MIN;
+    }
+
+    // map the key to a number within [0, 1) that increases along with
+    // the key, based on up to 8 chars following the first skip chars
+    double ToNumber(StringBlock const &key, std::size_t skip,
+                    bool fold) const {
+      double number = 0;
+      double scale = 1;
+      auto pos = key.first + std::min<std::ptrdiff_t>(skip, key.Distance());
+      for (int i = 0; i < 8 && pos < key.last; ++i, ++pos) {
+        // 0 is reserved for the end of the key, which is less than any char
+        scale /= size + 1;
+        number += rank[Index(*pos, fold)] * scale;
+      }
+      return number;
+    }
+  };
+
+  // value of the key to interpolate on when the keys are numbers
+  double ToNumber(Key const &key) const {
+    return config.order == Config::Order::kGeneral
+        ? key.numbers[0] : Key::ParseNumber(key.Column(0));
+  }
+
+  // return the position within [lb, ub) where the key is expected to be,
+  // assuming that the keys from lo_key to hi_key are evenly spread over it.
+  // only the first key column is interpolated on
+  char const *EstimatePosition(Key const &search_key,
+                               Key const &lo_key,
+                               Key const &hi_key,
+                               Alphabet const &alphabet,
+                               char const *lb, char const *ub) const {
+    double lo, hi, key;
+    if (config.order != Config::Order::kBytes) {
+      lo = ToNumber(lo_key);
+      hi = ToNumber(hi_key);
+      key = ToNumber(search_key);
+    } else {
+      auto lo_column = lo_key.Column(0);
+      auto hi_column = hi_key.Column(0);
+      // the keys in between share the common prefix of both ends
+      std::size_t skip = 0;
+      auto n = std::min(lo_column.Distance(), hi_column.Distance());
+      while (static_cast<std::ptrdiff_t>(skip) < n
+          && Alphabet::Index(lo_column.first[skip], config.fold)
+              == Alphabet::Index(hi_column.first[skip], config.fold))
+        ++skip;
+
+      lo = alphabet.ToNumber(lo_column, skip, config.fold);
+      hi = alphabet.ToNumber(hi_column, skip, config.fold);
+      key = alphabet.ToNumber(search_key.Column(0), skip, config.fold);
+    }
+    auto ratio = hi > lo ? (key - lo) / (hi - lo) : 0.5;
+    // NaN or infinite keys leave nothing to interpolate
+    if (!std::isfinite(ratio)) ratio = 0.5;
+    ratio = std::min(std::max(ratio, 0.0), 1.0);
+    return lb + static_cast<std::ptrdiff_t>(ratio * (ub - lb - 1));
+  }
+
+  /**
+   * Same as LowerBound, but probes where the key is expected to be,
+   * interpolating between the key columns at both ends of the range
+   * rather than bisecting it. Suited for uniformly distributed keys,
+   * e.g., hash values, which take ~ O( log2(log2(N)) ) probes
+   *
+   * Whenever a probe fails to halve the range, the next one bisects,
+   * which bounds the worst case to about twice the binary search
+   */
+  char const *Interpolate(Key const &search_key,
+                          char const *lb, char const *ub) {
+    if (lb >= ub) return std::min(lb, config.last);
+
+    // the key columns right before lb and at ub
+    auto first_row = ParseRow(lb, ub);
+    if (Compare(search_key, first_row.key) >= 0) return lb;
+    auto last_row = ParseRowAt(ub - 1, lb, ub);
+    if (Compare(search_key, last_row.key) < 0)
+      return std::min(last_row.last + 1, config.last);
+    auto lo_key = first_row.key;
+    auto hi_key = last_row.key;
+    lb = first_row.last + 1;
+    ub = last_row.first;
+    Alphabet alphabet;
+    alphabet.Add(search_key.Column(0), config.fold);
+    alphabet.Add(lo_key.Column(0), config.fold);
+    alphabet.Add(hi_key.Column(0), config.fold);
+
+    auto bisect = false;
+    while (lb < ub) {
+      auto size = ub - lb;
+      auto row = bisect ? Bisect(lb, ub)
+                        : ParseRowAt(EstimatePosition(search_key, lo_key,
+                                                      hi_key, alphabet, lb, ub),
+                                     lb, ub);
+      alphabet.Add(row.key.Column(0), config.fold);
+#ifndef NDEBUG
+      std::cerr << "*** " << StringBlock{row.first, row.last} << "\n";
+      std::cerr << "*** " << row.key << "\n\n";
+#endif // NDEBUG
+
+      if (Compare(search_key, row.key) >= 0) {
+        ub = row.first;
+        hi_key = row.key;
+      } else {
+        lb = row.last + 1;
+        lo_key = row.key;
+      }
+      bisect = !bisect && (ub - lb) * 2 > size;
+    }
+    return std::min(lb, config.last);
+  }
+
+  /**
+   * Same as above, over the whole file or the block given by the indexes
+   */
+  char const *LowerBound(Key const &search_key) {
+    auto lb = config.first;
+    auto ub = config.last;
+    if (config.index)
+      config.index->Narrow(search_key, lb, ub,
+                           [this](Key const &a, StringBlock const &b) {
+                             return Compare(a, MakeKey(b));
+                           });
+    if (config.eytzinger)
+      config.eytzinger->Narrow(search_key.Column(0), config.first, lb, ub,
+                               config.fold);
+    return LowerBound(search_key, lb, ub);
+  }
+
+  /**
+   * Same as LowerBound, but for a batch of search keys at once
+   *
+   * The keys in [kfirst, klast) must be sorted in ascending order.
+   * The batch is split at the key column of the midpoint row and each half
+   * recurses into its side of the file, so that the keys share the upper
+   * levels of the binary search and each probed row is visited only once
+   *
+   * complexity: ~ O( M * (K + log2(N)) ) rows probed for K keys
+   *
+   * It: random access iterator having value type of Key
+   * Out: random access iterator aligned with kfirst; receives lower bounds
+   */
+  template<typename It, typename Out>
+  void LowerBounds(It kfirst, It klast, Out out,
+                   char const *lb, char const *ub) {
+    if (kfirst == klast) return;
+    if (lb >= ub) {
+      std::fill(out, out + (klast - kfirst), std::min(lb, config.last));
+      return;
+    }
+
+    auto row = Bisect(lb, ub);
+
+    // keys leq to the column have their lower bound at or before this row
+    auto split = std::partition_point(
+        kfirst, klast, [this, &row](Key const &key) {
+          return Compare(key, row.key) >= 0;
+        });
+    LowerBounds(kfirst, split, out, lb, row.first);
+    LowerBounds(split, klast, out + (split - kfirst), row.last + 1, ub);
+  }
+
+  // write the row along with its row_sep, which the last row of the file
+  // may lack
+  void WriteRow(Row const &row, Writer &out) const {
+    if (row.last == config.last) {
+      out.Write(row.first, row.last);
+      out.Write(&config.row_sep, &config.row_sep + 1);
+    } else {
+      out.Write(row.first, row.last + 1);
+    }
+  }
+
+  // write the columns given by -o of the row within [first, last), where
+  // last is its row_sep or the end of the file. missing columns are empty.
+  // the columns are written as ranges of the mmap, and a column that
+  // follows the previous one within the row is merged with it along with
+  // the col_sep in between, so that no intermediate string is built
+  void WriteColumns(char const *first, char const *last, Writer &out) const {
+    // column c is [firsts[c], lasts[c]) for c < num_cols
+    std::array<char const *, std::numeric_limits<uint8_t>::max() + 1> firsts;
+    std::array<char const *, std::numeric_limits<uint8_t>::max() + 1> lasts;
+    int num_cols = 1;
+    for (auto pos = first; num_cols <= last_output_col; ++num_cols) {
+      auto sep = reinterpret_cast<char const *>(
+          std::memchr(pos, config.col_sep, last - pos));
+      firsts[num_cols] = pos;
+      lasts[num_cols] = sep ? sep : last;
+      if (!sep) {
+        ++num_cols;
+        break;
+      }
+      pos = sep + 1;
+    }
+
+    char const *prev = nullptr;
+    for (auto col: config.output_cols) {
+      if (prev) {
+        if (col < num_cols && firsts[col] == prev + 1) {
+          out.Write(prev, prev + 1);
+        } else {
+          out.Write(&config.col_sep, &config.col_sep + 1);
+        }
+      }
+      prev = last; // an empty column is never adjacent
+      if (col < num_cols) {
+        out.Write(firsts[col], lasts[col]);
+        prev = lasts[col];
+      }
+    }
+    // the last row of the file may lack its row_sep
+    if (last != config.last) out.Write(last, last + 1);
+    else out.Write(&config.row_sep, &config.row_sep + 1);
+  }
+
+  // write the rows within [first, last), where last is the beginning of
+  // a row or the end of the file
+  void WriteRows(char const *first, char const *last, Writer &out) const {
+    if (!config.output_cols.empty()) {
+      while (first < last) {
+        auto row_last = FindRowEnd(first, last);
+        WriteColumns(first, row_last, out);
+        first = row_last + 1;
+      }
+      return;
+    }
+    out.Write(first, last);
+    if (first < last && last == config.last && last[-1] != config.row_sep
+        && !config.record_size)
+      out.Write(&config.row_sep, &config.row_sep + 1);
+  }
+
+  /**
+   * Narrows [lb, ub) down to the gap that contains the first row at or
+   * after lb whose key column is not before the target, i.e., for which
+   * is_before does not hold, and which the rows before lb are all before
+   *
+   * The search gallops forward from lb, doubling the distance from a page
+   * onward, so that its cost grows with the distance to the target rather
+   * than the size of the range
+   */
+  template<typename F>
+  void Gallop(char const *&lb, char const *&ub, F is_before) const {
+    std::size_t step = 4096;
+    while (static_cast<std::size_t>(ub - lb) > step) {
+      auto row = ParseRowAt(lb + step, lb, ub);
+      if (!is_before(row.key)) {
+        ub = row.first;
+        return;
+      }
+      lb = row.last + 1;
+      step *= 2;
+    }
+  }
+
+  /**
+   * Same as LowerBound, but gallops forward from lb, which must not be past
+   * the lower bound of the search key, e.g., the lower bound of a lesser key
+   *
+   * complexity: ~ O( M * log2(D) ) where D is the distance from lb
+   */
+  char const *LowerBoundFrom(Key const &search_key, char const *lb) {
+    auto ub = config.last;
+    Gallop(lb, ub, [this, &search_key](Key const &column) {
+      return Compare(search_key, column) < 0;
+    });
+    return LowerBound(search_key, lb, ub);
+  }
+
+  /**
+   * Returns the end of the rows matching the search key that start at lb,
+   * i.e., the first row at or after lb whose key column neither matches
+   * nor is less than the search key
+   *
+   * lb must be the lower bound of the search key. The search gallops
+   * forward from lb and then bisects the last gap, so that its cost grows
+   * with the size of the matching range rather than that of the file
+   *
+   * complexity: ~ O( M * log2(R) ) where R is # of matching rows
+   */
+  char const *UpperBound(Key const &search_key,
+                         char const *lb, char const *ub) {
+    if (lb >= ub || !IsMatch(search_key, ParseRow(lb, ub).key)) return lb;
+    const auto last = ub;
+
+    const auto IsBefore = [this, &search_key](Key const &column) {
+      return Compare(search_key, column) < 0 || IsMatch(search_key, column);
+    };
+
+    Gallop(lb, ub, IsBefore);
+
+    // bisect
+    while (lb < ub) {
+      auto row = Bisect(lb, ub);
+      if (IsBefore(row.key)) lb = row.last + 1;
+      else ub = row.first;
+    }
+    // the last row of the file may lack its row_sep
+    return std::min(lb, last);
+  }
+
+  // count the rows within [first, last), where last is the beginning of
+  // a row or the end of the file
+  std::size_t CountRows(char const *first, char const *last) const {
+    if (config.record_size) return (last - first) / config.record_size;
+    auto count = std::count(first, last, config.row_sep);
+    if (first < last && last[-1] != config.row_sep) ++count;
+    return count;
+  }
+
+  // print 1 or 0 for config.exists
+  void PrintExists(bool exists, Writer &out) const {
+    static constexpr char kFlags[] = "01";
+    out.Write(kFlags + exists, kFlags + exists + 1);
+    out.Write(&config.row_sep, &config.row_sep + 1);
+  }
+
+  /**
+   * Prints the rows within [lb, ub), where ub is the beginning of a row
+   * or the end of the file. The rows are written as a whole from the mmap
+   *
+   * Instead of the rows, prints the number of them if config.count,
+   * or whether there is any (1 or 0) if config.exists
+   */
+  void PrintRows(char const *lb, char const *ub, Writer &out) const {
+    if (config.exists) return PrintExists(lb < ub, out);
+
+    // readahead the rest of a large range before it is read through
+    if (config.advise && ub - lb >= kReadaheadSize)
+      Advise(lb, ub, MADV_WILLNEED);
+    if (config.count) {
+      out.Copy(std::to_string(CountRows(lb, ub)));
+      out.Write(&config.row_sep, &config.row_sep + 1);
+      return;
+    }
+    WriteRows(lb, ub, out);
+  }
+
+  /**
+   * Prints the consecutive rows starting from lb that match the search key
+   * The matching range is found by UpperBound and printed by PrintRows
+   */
+  void PrintMatches(Key const &search_key, char const *lb,
+                    Writer &out) {
+    // the first row alone tells whether there is any match
+    if (config.exists)
+      return PrintExists(lb < config.last
+                         && IsMatch(search_key, ParseRow(lb, config.last).key),
+                         out);
+    PrintRows(lb, UpperBound(search_key, lb, config.last), out);
+  }
+
+  /**
+   * Prints the rows whose key column lies between lo and hi, i.e., neither
+   * less than lo nor greater than hi. Rows matching either bound, by prefix
+   * or exactly as in the search, are included unless the bound is excluded
+   *
+   * Both ends of the range are found by the binary search, and the rows
+   * in between are printed by PrintRows without being parsed
+   */
+  void PrintRange(Key const &lo, Key const &hi, bool exclude_lo,
+                  bool exclude_hi, Writer &out) {
+    auto lb = LowerBound(lo);
+    if (exclude_lo) lb = UpperBound(lo, lb, config.last);
+    auto ub = LowerBound(hi);
+    if (!exclude_hi) ub = UpperBound(hi, ub, config.last);
+    PrintRows(lb, std::max(lb, ub), out);
+  }
+};
+
+constexpr std::ptrdiff_t Searcher::kReadaheadSize;
+constexpr std::ptrdiff_t Searcher::kPrefetchDistance;
+
+/**
+ * Performs binary search on the sorted file to find match to the given key
+ */
+void Run(Config const &config, std::string const &key, Writer &out) {
+  Searcher searcher{config};
+  auto search_key = searcher.MakeKey(StringBlock{key});
+  // still print 0 for --count or --exists when nothing can match
+  if (config.first == config.last || !searcher.MayMatch(search_key))
+    return searcher.PrintRows(config.last, config.last, out);
+  auto lb = searcher.LowerBound(search_key);
+  searcher.PrintMatches(search_key, lb, out);
+}
+
+/**
+ * Same as Run, but on the compressed file. The block that contains the
+ * lower bound is decompressed and searched, followed by the next ones
+ * as long as the matching rows run on into them
+ */
+void RunCompressed(Config const &config, std::string const &key,
+                   Writer &out) {
+  auto const &file = *config.compressed;
+  Searcher searcher{config};
+  auto search_key = searcher.MakeKey(StringBlock{key});
+  auto i = file.Find(search_key, [&searcher](Key const &a,
+                                            StringBlock const &b) {
+    return searcher.Compare(a, searcher.MakeKey(b));
+  });
+
+  std::size_t count = 0;
+  for (auto lb_block = i; i < file.count; ++i) {
+    auto block = file.Get(i);
+    Config block_config = config;
+    block_config.first = block->data();
+    block_config.last = block->data() + block->size();
+    block_config.advise = false;
+    block_config.row_table = nullptr;
+    Searcher block_searcher{block_config};
+    auto lb = i == lb_block
+        ? block_searcher.LowerBound(search_key, block_config.first,
+                                    block_config.last)
+        : block_config.first;
+    auto ub = block_searcher.UpperBound(search_key, lb, block_config.last);
+    count += block_searcher.CountRows(lb, ub);
+
+    // the block may be evicted from the cache before out is flushed
+    if (!config.count && !config.exists) {
+      Writer rows;
+      block_searcher.WriteRows(lb, ub, rows);
+      for (const auto &range: rows.ranges) {
+        auto first = static_cast<char const *>(range.iov_base);
+        out.Copy(first, first + range.iov_len);
+      }
+    }
+    if (ub < block_config.last || (config.exists && count)) break;
+  }
+
+  if (config.exists) return searcher.PrintExists(count > 0, out);
+  if (config.count) {
+    out.Copy(std::to_string(count));
+    out.Write(&config.row_sep, &config.row_sep + 1);
+  }
+}
+
+/**
+ * Bounds of the range query given by --range
+ */
+struct Range {
+  std::string lo;
+  std::string hi;
+  bool exclude_lo = false;
+  bool exclude_hi = false;
+};
+
+/**
+ * Performs two binary searches on the sorted file to find the rows
+ * within the range
+ */
+void RunRange(Config const &config, Range const &range, Writer &out) {
+  Searcher searcher{config};
+  if (config.first == config.last)
+    return searcher.PrintRows(config.last, config.last, out);
+  searcher.PrintRange(searcher.MakeKey(StringBlock{range.lo}),
+                      searcher.MakeKey(StringBlock{range.hi}),
+                      range.exclude_lo, range.exclude_hi, out);
+}
+
+/**
+ * Splits [first, last) into at most n chunks of about the same size,
+ * each of which begins at a row
+ *
+ * Returns the boundaries of the chunks, including both first and last
+ */
+std::vector<char const *> SplitRows(Searcher const &searcher,
+                                    char const *first, char const *last,
+                                    int n) {
+  const std::size_t size = last - first;
+  std::vector<char const *> bounds{first};
+  for (int i = 1; i < n; ++i) {
+    auto pos = std::max(bounds.back(), first + size / n * i);
+    if (pos == first || pos == last) continue;
+    auto row = searcher.FindNextRow(pos, last);
+    if (row == last) break;
+    if (row > bounds.back()) bounds.push_back(row);
+  }
+  bounds.push_back(last);
+  return bounds;
+}
+
+/**
+ * Verifies that the file is sorted by the key column with config.jobs threads
+ *
+ * The file is split into chunks aligned on row_sep, each of which is checked
+ * along with the boundary to its preceding chunk. The first unordered row
+ * of the file is reported regardless of the number of threads
+ */
+void RunCheck(Config const &config) {
+  auto start = std::chrono::steady_clock::now();
+  Searcher searcher{config};
+  const std::size_t size = config.last - config.first;
+
+  auto bounds = SplitRows(searcher, config.first, config.last, config.jobs);
+  std::vector<char const *> unordered(bounds.size() - 1, nullptr);
+  // an error within a chunk, e.g., a row short of columns, is kept until
+  // the chunks before it are known to be in order
+  std::vector<std::exception_ptr> errors(unordered.size());
+  const auto Check = [&searcher, &bounds, &unordered, &errors](std::size_t i) {
+    try {
+      unordered[i] = searcher.FindUnordered(bounds[i], bounds[i + 1]);
+    } catch (...) {
+      errors[i] = std::current_exception();
+    }
+  };
+  std::vector<std::thread> workers;
+  for (std::size_t i = 1; i < unordered.size(); ++i)
+    workers.emplace_back(Check, i);
+  Check(0);
+  for (auto &worker: workers)
+    worker.join();
+
+  // report the first problem in the order of the file
+  for (std::size_t i = 0; i < unordered.size(); ++i) {
+    if (errors[i]) std::rethrow_exception(errors[i]);
+    if (auto pos = unordered[i])
+      HandleError("Unordered at row:\n" +
+                  std::string(pos, searcher.FindRowEnd(pos, config.last)));
+  }
+
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  std::cerr << "Checked " << size << " bytes in " << elapsed.count() << "s ("
+            << size / elapsed.count() / 1e9 << " GB/s)\n";
+}
+
+/**
+ * Creates the sparse index of the sorted file, or the packed index of the
+ * key prefixes with eytzinger
+ * Each entry covers block_size bytes of the file, which bounds the number
+ * of pages a search needs to touch in the file
+ */
+void RunIndex(Config const &config, std::size_t block_size, bool eytzinger,
+              std::string const &filename) {
+  if (block_size == 0) HandleError("SIZE must be positive");
+  if (eytzinger && config.order != Config::Order::kBytes)
+    HandleError("The --eytzinger index cannot be used with -n or -g");
+  Searcher searcher{config};
+  std::vector<uint64_t> offsets;
+  std::vector<uint64_t> keys{0};
+  std::vector<uint64_t> prefixes;
+  std::string blob;
+
+  auto pos = config.first;
+  while (pos < config.last) {
+    auto row = searcher.ParseRow(pos, config.last);
+    offsets.push_back(pos - config.first);
+    if (eytzinger) {
+      prefixes.push_back(
+          EytzingerIndex::Prefix(row.key.Column(0), config.fold));
+    } else {
+      // the key columns are delimited by col_sep, same as a search key
+      for (int i = 0; i < row.key.size; ++i) {
+        if (i) blob += config.col_sep;
+        blob.append(row.key.firsts[i], row.key.lasts[i]);
+      }
+      keys.push_back(blob.size());
+    }
+
+    // skip to the first row that begins at or after the next block
+    auto next = pos + std::min<std::size_t>(block_size, config.last - pos);
+    pos = searcher.FindNextRow(std::max(row.last + 1, next), config.last);
+  }
+
+  std::ofstream os{filename, std::ios::binary | std::ios::trunc};
+  if (!os) HandleError("Failed to open: " + filename);
+  if (eytzinger) {
+    EytzingerIndex::Header header{};
+    header.file_size = config.last - config.first;
+    header.block_size = block_size;
+    header.stamp = config.stamp;
+    header.layout = KeyLayout::Of(config);
+    header.fold = config.fold;
+    EytzingerIndex::Write(os, header, prefixes, offsets);
+  } else {
+    SparseIndex::Header header{};
+    std::memcpy(header.magic, SparseIndex::kMagic, sizeof(header.magic));
+    header.file_size = config.last - config.first;
+    header.block_size = block_size;
+    header.count = offsets.size();
+    header.stamp = config.stamp;
+    header.layout = KeyLayout::Of(config);
+
+    os.write(reinterpret_cast<char const *>(&header), sizeof(header));
+    os.write(reinterpret_cast<char const *>(offsets.data()),
+             offsets.size() * sizeof(uint64_t));
+    os.write(reinterpret_cast<char const *>(keys.data()),
+             keys.size() * sizeof(uint64_t));
+    os << blob;
+  }
+  if (!os.flush()) HandleError("Failed to write: " + filename);
+}
+
+/**
+ * Creates the Bloom filter of the keys of the sorted file, sized for the
+ * given false positive rate of -w searches of absent keys
+ */
+void RunBloom(Config const &config, double fp_rate,
+              std::string const &filename) {
+  if (!(fp_rate > 0 && fp_rate < 1)) HandleError("RATE must be within (0, 1)");
+  if (config.order != Config::Order::kBytes)
+    HandleError("The --bloom filter cannot be used with -n or -g");
+  Searcher searcher{config};
+  // the rows of a key are adjacent, so that each key is visited once
+  const auto ForEachKey = [&searcher, &config](auto f) {
+    Key prev;
+    for (auto pos = config.first; pos < config.last;) {
+      auto row = searcher.ParseRow(pos, config.last);
+      if (pos == config.first || searcher.Compare(prev, row.key) != 0)
+        f(row.key);
+      prev = row.key;
+      pos = row.last + 1;
+    }
+  };
+
+  uint64_t count = 0;
+  ForEachKey([&count](Key const &) { ++count; });
+
+  // start from the size of the standard Bloom filter, and grow it until
+  // the blocks make up for their higher rate
+  auto bits_per_key = -std::log(fp_rate) / (std::log(2) * std::log(2));
+  uint32_t num_hashes;
+  while (true) {
+    num_hashes = std::min<uint32_t>(
+        BloomFilter::kMaxHashes,
+        std::max(1L, std::lround(bits_per_key * std::log(2))));
+    auto keys_per_block = BloomFilter::kBlockBits / bits_per_key;
+    if (BloomFilter::EstimateRate(keys_per_block, num_hashes) <= fp_rate
+        || keys_per_block < 1)
+      break;
+    bits_per_key *= 1.05;
+  }
+  BloomFilter::Header header{};
+  header.num_blocks = std::max<uint64_t>(
+      1, std::ceil(count * bits_per_key / BloomFilter::kBlockBits));
+  header.num_hashes = num_hashes;
+  std::vector<uint64_t> blocks(header.num_blocks * BloomFilter::kBlockBits
+                               / 64);
+  ForEachKey([&](Key const &key) {
+    BloomFilter::ForEachBit(
+        BloomFilter::Hash(key, config.col_sep, config.fold),
+        header.num_blocks, header.num_hashes,
+        [&blocks](uint64_t word, uint64_t mask) { blocks[word] |= mask; });
+  });
+
+  std::memcpy(header.magic, BloomFilter::kMagic, sizeof(header.magic));
+  header.file_size = config.last - config.first;
+  header.count = count;
+  header.stamp = config.stamp;
+  header.layout = KeyLayout::Of(config);
+  header.fold = config.fold;
+
+  std::ofstream os{filename, std::ios::binary | std::ios::trunc};
+  if (!os) HandleError("Failed to open: " + filename);
+  os.write(reinterpret_cast<char const *>(&header), sizeof(header));
+  os.write(reinterpret_cast<char const *>(blocks.data()),
+           blocks.size() * sizeof(uint64_t));
+  if (!os.flush()) HandleError("Failed to write: " + filename);
+}
+
+/**
+ * Compresses the sorted file into blocks of at least block_size bytes of
+ * whole rows, along with the key column of the first row of each block
+ */
+void RunCompress(Config const &config, std::size_t block_size,
+                 std::string const &filename) {
+  if (block_size == 0) HandleError("SIZE must be positive");
+  Searcher searcher{config};
+  std::vector<uint64_t> offsets;
+  std::vector<uint64_t> data_offsets;
+  std::vector<uint64_t> keys{0};
+  std::string blob;
+  std::vector<Bytef> buffer;
+
+  std::ofstream os{filename, std::ios::binary | std::ios::trunc};
+  if (!os) HandleError("Failed to open: " + filename);
+  CompressedFile::Header header{};
+  os.write(reinterpret_cast<char const *>(&header), sizeof(header));
+
+  auto data_offset = sizeof(header);
+  auto pos = config.first;
+  while (pos < config.last) {
+    auto row = searcher.ParseRow(pos, config.last);
+    offsets.push_back(pos - config.first);
+    data_offsets.push_back(data_offset);
+    for (int i = 0; i < row.key.size; ++i) {
+      if (i) blob += config.col_sep;
+      blob.append(row.key.firsts[i], row.key.lasts[i]);
+    }
+    keys.push_back(blob.size());
+
+    // the block ends at the first row that begins at or after block_size
+    auto next = pos + std::min<std::size_t>(block_size, config.last - pos);
+    next = searcher.FindNextRow(std::max(row.last + 1, next), config.last);
+    buffer.resize(compressBound(next - pos));
+    auto size = static_cast<uLongf>(buffer.size());
+    if (compress(buffer.data(), &size, reinterpret_cast<Bytef const *>(pos),
+                 next - pos) != Z_OK)
+      HandleError("Failed to compress: " + filename);
+    os.write(reinterpret_cast<char const *>(buffer.data()), size);
+    data_offset += size;
+    pos = next;
+  }
+  offsets.push_back(config.last - config.first);
+  data_offsets.push_back(data_offset);
+
+  os.write(reinterpret_cast<char const *>(offsets.data()),
+           offsets.size() * sizeof(uint64_t));
+  os.write(reinterpret_cast<char const *>(data_offsets.data()),
+           data_offsets.size() * sizeof(uint64_t));
+  os.write(reinterpret_cast<char const *>(keys.data()),
+           keys.size() * sizeof(uint64_t));
+  os << blob;
+
+  // the header goes last, once the location of the tables is known
+  std::memcpy(header.magic, CompressedFile::kMagic, sizeof(header.magic));
+  header.file_size = config.last - config.first;
+  header.block_size = block_size;
+  header.count = offsets.size() - 1;
+  header.table_offset = data_offset;
+  header.layout = KeyLayout::Of(config);
+  os.seekp(0);
+  os.write(reinterpret_cast<char const *>(&header), sizeof(header));
+  if (!os.flush()) HandleError("Failed to write: " + filename);
+}
+
+/**
+ * Temporary files that are removed upon destruction
+ */
+struct TempFiles {
+  std::vector<std::string> paths;
+
+  TempFiles() = default;
+  TempFiles(TempFiles const &) = delete;
+  TempFiles &operator=(TempFiles const &) = delete;
+
+  ~TempFiles() {
+    for (const auto &path: paths)
+      unlink(path.c_str());
+  }
+
+  std::string const &Create(std::string const &dir) {
+    auto path = dir + "/bsq-sort-XXXXXX";
+    auto fd = mkstemp(&path[0]);
+    if (fd == -1) HandleError("Failed to create a temporary file in: " + dir);
+    close(fd);
+    paths.push_back(std::move(path));
+    return paths.back();
+  }
+};
+
+/**
+ * Stable sort of the rows by the key column with the given number of threads
+ *
+ * Each thread sorts its own part of the rows, and then the sorted parts
+ * are merged pairwise, again in parallel
+ */
+void SortRows(Searcher const &searcher, std::vector<Row> &rows, int jobs) {
+  const auto Less = [&searcher](Row const &a, Row const &b) {
+    return searcher.Compare(a.key, b.key) > 0;
+  };
+  const auto n = rows.size();
+  if (n < 2) return;
+  auto width = (n + jobs - 1) / jobs;
+
+  std::vector<std::thread> workers;
+  for (std::size_t i = 0; i < n; i += width)
+    workers.emplace_back([&rows, &Less, i, n, width] {
+      std::stable_sort(rows.begin() + i,
+                       rows.begin() + std::min(i + width, n), Less);
+    });
+  for (auto &worker: workers)
+    worker.join();
+
+  for (; width < n; width *= 2) {
+    workers.clear();
+    for (std::size_t i = 0; i + width < n; i += 2 * width)
+      workers.emplace_back([&rows, &Less, i, n, width] {
+        std::inplace_merge(rows.begin() + i, rows.begin() + i + width,
+                           rows.begin() + std::min(i + 2 * width, n), Less);
+      });
+    for (auto &worker: workers)
+      worker.join();
+  }
+}
+
+/**
+ * Sorts the file by the key column with the same ordering as the search,
+ * i.e., Searcher::Compare, so that the output is always valid for bsq.
+ * The sort is stable, same as `LC_ALL=C sort -s`
+ *
+ * Rows are read in runs that fit within the memory budget, each of which
+ * is sorted with config.jobs threads and written to a temporary file
+ * in tmp_dir. The runs are then k-way merged to the output
+ *
+ * filename: output file, which may be the input file itself.
+ * Default: stdout
+ */
+void RunSort(Config const &config, std::size_t budget,
+             std::string const &tmp_dir, std::string const &filename) {
+  Searcher searcher{config};
+  TempFiles temp_files;
+
+  // the output replaces filename only once it is complete,
+  // as the input may be the output itself
+  std::string output_filename = filename + ".bsq-sort-tmp";
+  auto fd = STDOUT_FILENO;
+  if (!filename.empty()) {
+    fd = open(output_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) HandleError("Failed to open: " + output_filename);
+    temp_files.paths.push_back(output_filename);
+  }
+  Writer out{fd};
+
+  std::vector<std::string> runs;
+  std::vector<Row> rows;
+  auto pos = config.first;
+  while (pos < config.last) {
+    // a run takes as many rows as fit within the budget
+    auto run_first = pos;
+    rows.clear();
+    do {
+      rows.push_back(searcher.ParseRow(pos, config.last));
+      pos = rows.back().last + 1;
+    } while (pos < config.last
+        && (pos - run_first) + rows.size() * sizeof(Row) < budget);
+    SortRows(searcher, rows, config.jobs);
+
+    // no need for a run if the whole file fits
+    if (runs.empty() && pos >= config.last) {
+      for (const auto &row: rows)
+        searcher.WriteRow(row, out);
+      break;
+    }
+
+    runs.push_back(temp_files.Create(tmp_dir));
+    auto run_fd = open(runs.back().c_str(), O_WRONLY | O_TRUNC);
+    if (run_fd == -1) HandleError("Failed to open: " + runs.back());
+    Writer run{run_fd};
+    for (const auto &row: rows)
+      searcher.WriteRow(row, run);
+    run.Flush();
+    close(run_fd);
+  }
+  std::vector<Row>().swap(rows);
+
+  // k-way merge of the runs, where ties go to the earlier run for stability
+  struct Cursor {
+    Row row;
+    std::size_t run;
+  };
+  const auto Greater = [&searcher](Cursor const &a, Cursor const &b) {
+    auto cmp = searcher.Compare(a.row.key, b.row.key);
+    return cmp < 0 || (cmp == 0 && a.run > b.run);
+  };
+  std::vector<std::unique_ptr<MappedFile>> run_files;
+  std::priority_queue<Cursor, std::vector<Cursor>, decltype(Greater)>
+      heap{Greater};
+  for (const auto &run: runs) {
+    run_files.emplace_back(new MappedFile{run});
+    auto const &run_file = *run_files.back();
+    if (run_file.first != run_file.last)
+      heap.push({searcher.ParseRow(run_file.first, run_file.last),
+                 run_files.size() - 1});
+  }
+  while (!heap.empty()) {
+    auto cursor = heap.top();
+    heap.pop();
+    searcher.WriteRow(cursor.row, out);
+    auto next = cursor.row.last + 1;
+    auto const &run_file = *run_files[cursor.run];
+    if (next < run_file.last)
+      heap.push({searcher.ParseRow(next, run_file.last), cursor.run});
+  }
+
+  out.Flush();
+  if (!filename.empty()) {
+    if (close(fd) == -1) HandleError("Failed to write: " + output_filename);
+    if (std::rename(output_filename.c_str(), filename.c_str()) != 0)
+      HandleError("Failed to rename to: " + filename);
+    temp_files.paths.erase(temp_files.paths.begin());
+  }
+}
+
+/**
+ * Same as calling Run for each key, but shares the binary search among keys
+ * Results are printed in the same order as the given keys
+ */
+template<typename It>
+void RunBatch(Config const &config, It kfirst, It klast, Writer &out) {
+  Searcher searcher{config};
+
+  // the index already narrows each key down to a single block
+  if (config.index || config.eytzinger) {
+    for (; kfirst != klast; ++kfirst) {
+      auto search_key = searcher.MakeKey(StringBlock{*kfirst});
+      searcher.PrintMatches(search_key,
+                            searcher.MayMatch(search_key)
+                                ? searcher.LowerBound(search_key)
+                                : config.last, out);
+    }
+    return;
+  }
+
+  std::size_t size = klast - kfirst;
+  std::vector<Key> keys;
+  keys.reserve(size);
+  for (auto it = kfirst; it != klast; ++it)
+    keys.push_back(searcher.MakeKey(StringBlock{*it}));
+
+  // the keys ruled out by the Bloom filter are left out of the search
+  std::vector<std::size_t> order;
+  order.reserve(size);
+  for (std::size_t i = 0; i < size; ++i)
+    if (searcher.MayMatch(keys[i])) order.push_back(i);
+  std::sort(order.begin(), order.end(),
+            [&searcher, &keys](std::size_t a, std::size_t b) {
+              return searcher.Compare(keys[a], keys[b]) > 0;
+            });
+
+  std::vector<Key> sorted_keys;
+  sorted_keys.reserve(order.size());
+  for (auto idx: order)
+    sorted_keys.push_back(keys[idx]);
+
+  std::vector<char const *> sorted_bounds(order.size());
+  searcher.LowerBounds(sorted_keys.begin(), sorted_keys.end(),
+                       sorted_bounds.begin(), config.first, config.last);
+
+  std::vector<char const *> bounds(size, config.last);
+  for (std::size_t i = 0; i < order.size(); ++i)
+    bounds[order[i]] = sorted_bounds[i];
+
+  for (std::size_t i = 0; i < size; ++i)
+    searcher.PrintMatches(keys[i], bounds[i], out);
+}
+
+/**
+ * Same as calling Run for each key, but for keys in ascending order,
+ * as in a merge join. Each key is searched by galloping forward from the
+ * lower bound of the previous key, so that the file is read through
+ * nearly sequentially when the keys are dense
+ *
+ * A key less than the previous one is searched over the whole file
+ */
+template<typename It>
+void RunJoin(Config const &config, It kfirst, It klast, Writer &out) {
+  Searcher searcher{config};
+  auto lb = config.first;
+  auto prev = searcher.MakeKey(StringBlock{lb, lb});
+  for (auto it = kfirst; it != klast; ++it) {
+    auto search_key = searcher.MakeKey(StringBlock{*it});
+    if (config.first == config.last || !searcher.MayMatch(search_key)) {
+      searcher.PrintRows(config.last, config.last, out);
+      continue;
+    }
+    auto ascending = it != kfirst && searcher.Compare(prev, search_key) >= 0;
+    lb = ascending ? searcher.LowerBoundFrom(search_key, lb)
+                   : searcher.LowerBound(search_key);
+    searcher.PrintMatches(search_key, lb, out);
+    prev = search_key;
+  }
+}
+
+/**
+ * Searches each of the keys in [kfirst, klast) in order
+ */
+template<typename It>
+void RunKeys(Config const &config, It kfirst, It klast, Writer &out) {
+  if (config.compressed) {
+    for (; kfirst != klast; ++kfirst)
+      RunCompressed(config, *kfirst, out);
+  } else if (config.join) {
+    RunJoin(config, kfirst, klast, out);
+  } else if (config.batch) {
+    RunBatch(config, kfirst, klast, out);
+  } else {
+    for (; kfirst != klast; ++kfirst)
+      Run(config, *kfirst, out);
+  }
+}
+
+/**
+ * Reads the search keys delimited by row_sep from a file descriptor,
+ * e.g., stdin, as they arrive rather than all of them upfront
+ */
+struct KeyReader {
+  // how long Read waits for a key before returning none, in milliseconds
+  static constexpr int kPollTimeout = 100;
+
+  int fd;
+  char row_sep;
+  std::vector<char> buffer = std::vector<char>(1 << 16);
+  std::string pending; // read in, but not yet returned
+  bool eof = false;
+
+  KeyReader(int fd, char row_sep) : fd(fd), row_sep(row_sep) {}
+
+  /**
+   * Reads up to max keys into keys. The keys that arrive together are
+   * returned together, without waiting for the rest of the chunk, and
+   * none is returned if none arrives within kPollTimeout
+   *
+   * Returns false at the end of the input
+   */
+  bool Read(std::vector<std::string> &keys, std::size_t max) {
+    keys.clear();
+    while (true) {
+      std::string::size_type first = 0;
+      std::string::size_type last;
+      while (keys.size() < max
+          && (last = pending.find(row_sep, first)) != std::string::npos) {
+        keys.push_back(pending.substr(first, last - first));
+        first = last + 1;
+      }
+      pending.erase(0, first);
+      if (keys.size() == max) return true;
+      if (eof) {
+        // the last key may lack its row_sep
+        if (!pending.empty()) keys.push_back(std::move(pending));
+        pending.clear();
+        return !keys.empty();
+      }
+
+      // wait for more only if there is no key to return yet
+      pollfd pfd{fd, POLLIN, 0};
+      auto ready = poll(&pfd, 1, keys.empty() ? kPollTimeout : 0);
+      if (ready == -1 && errno == EINTR) continue;
+      if (ready == -1) HandleError("Failed to poll the keys");
+      if (ready == 0) return true;
+
+      auto n = read(fd, buffer.data(), buffer.size());
+      if (n == -1 && errno == EINTR) continue;
+      if (n == -1) HandleError("Failed to read the keys");
+      if (n == 0) eof = true;
+      else pending.append(buffer.data(), n);
+    }
+  }
+};
+
+constexpr int KeyReader::kPollTimeout;
+
+/**
+ * Same as RunKeys, but as a pipeline of a reader thread, config.jobs
+ * lookup threads and the calling thread as the writer, so that the keys
+ * are searched as they are read and the results are written as soon as
+ * they are found
+ *
+ * The reader hands out the keys in chunks, and each lookup thread buffers
+ * the output of its chunk. The chunks are written in the order of the keys,
+ * or as soon as they are done if config.unordered. No more than
+ * kMaxPending chunks per thread are in flight, so that the memory stays
+ * constant regardless of the number of keys
+ *
+ * F: function of type (std::vector<std::string> &keys, std::size_t max)
+ *    -> bool that reads up to max keys, same as KeyReader::Read
+ */
+template<typename F>
+void RunPipeline(Config const &config, F read_keys, Writer &out) {
+  constexpr std::size_t kChunkSize = 256;
+  // -b shares the binary search among the keys of a chunk
+  constexpr std::size_t kBatchChunkSize = 1 << 14;
+  constexpr std::size_t kMaxPending = 4;
+  const auto chunk_size = config.batch ? kBatchChunkSize : kChunkSize;
+  const auto max_pending = kMaxPending * config.jobs;
+
+  // chunks read but not yet searched, and their outputs not yet written,
+  // numbered in the order of the keys, or of completion if config.unordered
+  std::queue<std::pair<std::size_t, std::vector<std::string>>> chunks;
+  std::map<std::size_t, Writer> outputs;
+  std::size_t num_read = 0;
+  std::size_t num_done = 0;
+  std::size_t num_written = 0;
+  bool eof = false;
+  std::exception_ptr error;
+  std::mutex mutex;
+  std::condition_variable cv;
+
+  const auto Fail = [&] {
+    std::lock_guard<std::mutex> lock{mutex};
+    if (!error) error = std::current_exception();
+    cv.notify_all();
+  };
+
+  const auto Read = [&] {
+    try {
+      std::vector<std::string> keys;
+      while (true) {
+        {
+          std::unique_lock<std::mutex> lock{mutex};
+          cv.wait(lock, [&] {
+            return num_read - num_written < max_pending || error;
+          });
+          if (error) return;
+        }
+        if (!read_keys(keys, chunk_size)) break;
+        if (keys.empty()) continue;
+
+        std::lock_guard<std::mutex> lock{mutex};
+        chunks.emplace(num_read++, std::move(keys));
+        keys.clear();
+        cv.notify_all();
+      }
+      std::lock_guard<std::mutex> lock{mutex};
+      eof = true;
+      cv.notify_all();
+    } catch (...) {
+      Fail();
+    }
+  };
+
+  const auto Work = [&] {
+    try {
+      while (true) {
+        std::pair<std::size_t, std::vector<std::string>> chunk;
+        {
+          std::unique_lock<std::mutex> lock{mutex};
+          cv.wait(lock, [&] { return !chunks.empty() || eof || error; });
+          if (error || chunks.empty()) return;
+          chunk = std::move(chunks.front());
+          chunks.pop();
+        }
+        Writer chunk_out;
+        RunKeys(config, chunk.second.begin(), chunk.second.end(), chunk_out);
+
+        std::lock_guard<std::mutex> lock{mutex};
+        outputs.emplace(config.unordered ? num_done++ : chunk.first,
+                        std::move(chunk_out));
+        cv.notify_all();
+      }
+    } catch (...) {
+      Fail();
+    }
+  };
+
+  std::thread reader{Read};
+  std::vector<std::thread> workers;
+  for (int i = 0; i < config.jobs; ++i)
+    workers.emplace_back(Work);
+
+  try {
+    while (true) {
+      // write whichever outputs are ready in order, and then flush them
+      // before waiting for more
+      std::vector<Writer> ready;
+      {
+        std::unique_lock<std::mutex> lock{mutex};
+        cv.wait(lock, [&] {
+          return outputs.count(num_written)
+              || (eof && num_written == num_read) || error;
+        });
+        if (error) break;
+        for (auto it = outputs.find(num_written); it != outputs.end();
+             it = outputs.find(++num_written)) {
+          ready.push_back(std::move(it->second));
+          outputs.erase(it);
+        }
+        cv.notify_all();
+      }
+      if (ready.empty()) break;
+      for (auto &output: ready)
+        out.Write(std::move(output));
+      out.Flush();
+    }
+  } catch (...) {
+    Fail();
+  }
+
+  reader.join();
+  for (auto &worker: workers)
+    worker.join();
+  if (error) std::rethrow_exception(error);
+}
+
+/**
+ * Answers the queries from a single client of the server
+ * Keys that arrive together are answered together with a single write
+ */
+void ServeClient(Config const &config, int fd) {
+  std::vector<char> buffer(1 << 16);
+  std::string pending;
+  Writer out{fd};
+  while (true) {
+    auto n = read(fd, buffer.data(), buffer.size());
+    if (n == -1 && errno == EINTR) continue;
+    if (n <= 0) break;
+    pending.append(buffer.data(), n);
+
+    std::vector<std::string> keys;
+    std::string::size_type first = 0;
+    std::string::size_type last;
+    while ((last = pending.find(config.row_sep, first)) != std::string::npos) {
+      keys.push_back(pending.substr(first, last - first));
+      first = last + 1;
+    }
+    pending.erase(0, first);
+    if (keys.empty()) continue;
+
+    for (const auto &key: keys) {
+      // the size goes first, since a matching row can itself be empty
+      Writer answer;
+      Run(config, key, answer);
+      out.Copy(std::to_string(answer.size) + config.row_sep);
+      out.Write(std::move(answer));
+    }
+    out.Flush();
+  }
+}
+
+/**
+ * Keeps the file mapped and answers queries over the Unix domain socket
+ * with a thread per client, until the process is terminated
+ *
+ * Line protocol: each line received is a search key, which is answered
+ * with a line of the size of the matching rows in bytes, followed by them
+ */
+void RunServer(Config const &config, std::string const &path) {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path))
+    HandleError("Socket path is too long: " + path);
+  std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+  // a socket left over by a previous server would make bind fail
+  struct stat sb;
+  if (stat(path.c_str(), &sb) == 0 && S_ISSOCK(sb.st_mode))
+    unlink(path.c_str());
+
+  auto fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) HandleError("Failed to create socket");
+  if (bind(fd, reinterpret_cast<sockaddr const *>(&addr), sizeof(addr)) == -1)
+    HandleError("Failed to bind: " + path);
+  if (listen(fd, SOMAXCONN) == -1) HandleError("Failed to listen: " + path);
+
+  // a client that disconnects early must not terminate the server
+  std::signal(SIGPIPE, SIG_IGN);
+
+  while (true) {
+    auto client = accept(fd, nullptr, nullptr);
+    if (client == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      HandleError("Failed to accept: " + std::string(strerror(errno)));
+    }
+    std::thread([&config, client] {
+      try {
+        ServeClient(config, client);
+      } catch (std::exception const &e) {
+        std::cerr << "Error: " << e.what() << "\n";
+      }
+      close(client);
+    }).detach();
+  }
+}
+
+int main(int argc, const char **argv) {
+  std::vector<std::string> args;
+  args.reserve(argc);
+  for (auto it = argv; it != argv + argc; ++it)
+    args.emplace_back(*it);
+
+  Config config;
+  std::string command;
+  std::string filename;
+  std::vector<std::string> index_filenames;
+  bool eytzinger = false;
+  double bloom_fp_rate = 0;
+  std::size_t block_size = 0;
+  std::size_t sort_budget = std::size_t{1} << 30;
+  std::string tmp_dir = std::getenv("TMPDIR") ? std::getenv("TMPDIR") : "/tmp";
+  std::string socket_path;
+  std::size_t populate_limit = 0;
+  std::size_t row_table_size = 0;
+  Range range;
+  bool range_query = false;
+  bool key_by_offset = false;
+  std::vector<std::string> search_keys;
+  const auto ExtractChar = [](std::string const &s) { return s.front(); };
+  const auto ExtractInt = [](std::string const &s) { return std::stoi(s); };
+  const auto ExtractDouble = [](std::string const &s) { return std::stod(s); };
+  const auto ExtractString = [](std::string const &s) { return s; };
+
+  if (args.size() > 1 && (args[1] == "index" || args[1] == "sort"
+                        || args[1] == "compress"))
+    command = args[1];
+
+  // parse options & arguments
+  bool read_literal = false;
+  try {
+    for (auto it = args.begin() + 1 + !command.empty(); it != args.end();
+         ++it) {
+      if (*it == "--") {
+        read_literal = true;
+        continue;
+      }
+
+      if (it->size() >= 2 && it->front() == '-' && !read_literal) {
+        switch (it->at(1)) {
+          case 'h':
+            return Usage(args.front());
+          case 'b':
+          case 'c':
+          case 'w':
+          case 'f':
+          case 'n':
+          case 'g':
+            std::for_each(it->begin() + 1, it->end(), [&config](char c) {
+              switch (c) {
+                case 'b':
+                  config.batch = true;
+                  break;
+                case 'w':
+                  config.exact_match = true;
+                  break;
+                case 'c':
+                  config.check = true;
+                  break;
+                case 'f':
+                  config.fold = true;
+                  break;
+                case 'n':
+                  config.order = Config::Order::kNumeric;
+                  break;
+                case 'g':
+                  config.order = Config::Order::kGeneral;
+                  break;
+                default:
+                  HandleError("Invalid option: -" + std::string(1, c));
+              }
+            });
+            break;
+          case 't':
+            config.col_sep = ExtractArgument(it, args.end(), ExtractChar);
+            break;
+          case 'k': {
+            auto cols = ExtractArgument(it, args.end(), ParseColumns);
+            if (cols.size() > Config::kMaxKeyColumns)
+              HandleError("At most " + std::to_string(Config::kMaxKeyColumns)
+                          + " key columns are supported");
+            config.cols.fill(0);
+            std::copy(cols.begin(), cols.end(), config.cols.begin());
+            config.num_cols = cols.size();
+          }
+            break;
+          case 'o':
+            config.output_cols = ExtractArgument(it, args.end(), ParseColumns);
+            break;
+          case 'j':
+            config.jobs = ExtractArgument(it, args.end(), ExtractInt);
+            if (config.jobs < 1) HandleError("N must be positive");
+            break;
+          case 'i':
+            index_filenames.push_back(
+                ExtractArgument(it, args.end(), ExtractString));
+            break;
+          case 'B':
+            block_size = ExtractArgument(it, args.end(), ParseSize);
+            break;
+          case 'S':
+            sort_budget = ExtractArgument(it, args.end(), ParseSize);
+            break;
+          case 'T':
+            tmp_dir = ExtractArgument(it, args.end(), ExtractString);
+            break;
+          case '-': {
+            auto name = it->substr(2, it->find('=') - 2);
+            if (name == "serve")
+              socket_path = ExtractLongArgument(it, args.end(), ExtractString);
+            else if (name == "unordered")
+              config.unordered = true;
+            else if (name == "no-advise")
+              config.advise = false;
+            else if (name == "populate")
+              populate_limit = ExtractLongArgument(it, args.end(), ParseSize);
+            else if (name == "prefetch") {
+              config.prefetch = it->find('=') == std::string::npos
+                  ? 1 : ExtractLongArgument(it, args.end(), ExtractInt);
+              if (config.prefetch < 0 || config.prefetch > 4)
+                HandleError("DEPTH must be within [0, 4]");
+            } else if (name == "row-table") {
+              row_table_size = it->find('=') == std::string::npos
+                  ? 1 << 16 : ExtractLongArgument(it, args.end(), ParseSize);
+              if (row_table_size == 0) HandleError("SIZE must be positive");
+            } else if (name == "interpolate")
+              config.interpolate = true;
+            else if (name == "range") {
+              range_query = true;
+              range.lo = ExtractLongArgument(it, args.end(), ExtractString);
+              if (std::next(it) == args.end())
+                HandleError("Argument not found: --range " + range.lo);
+              range.hi = *++it;
+            } else if (name == "exclude-lo")
+              range.exclude_lo = true;
+            else if (name == "exclude-hi")
+              range.exclude_hi = true;
+            else if (name == "record-size")
+              config.record_size = ExtractLongArgument(it, args.end(),
+                                                       ParseSize);
+            else if (name == "key-offset") {
+              key_by_offset = true;
+              config.key_offset = ExtractLongArgument(it, args.end(),
+                                                      ParseSize);
+            } else if (name == "key-len") {
+              key_by_offset = true;
+              config.key_len = ExtractLongArgument(it, args.end(), ParseSize);
+              if (config.key_len == 0) HandleError("LEN must be positive");
+            } else if (name == "eytzinger")
+              eytzinger = true;
+            else if (name == "bloom") {
+              bloom_fp_rate = it->find('=') == std::string::npos
+                  ? 0.01 : ExtractLongArgument(it, args.end(), ExtractDouble);
+              if (!(bloom_fp_rate > 0 && bloom_fp_rate < 1))
+                HandleError("RATE must be within (0, 1)");
+            }
+            else if (name == "join")
+              config.join = true;
+            else if (name == "count")
+              config.count = true;
+            else if (name == "exists")
+              config.exists = true;
+            else
+              HandleError("Invalid option: " + *it);
+          }
+            break;
+          default:
+            HandleError("Invalid argument: " + *it);
+        }
+      } else if (it->front() != '-' || read_literal) {
+        if (filename.empty()) filename = std::move(*it);
+        else search_keys.push_back(std::move(*it));
+      } else {
+        HandleError("Invalid option: " + *it);
+      }
+      read_literal = false;
+    }
+
+    if (filename.empty())
+      return Usage(args.front());
+
+    if (config.count && config.exists)
+      HandleError("--count and --exists cannot be used together");
+    if (config.batch && config.join)
+      HandleError("-b and --join cannot be used together");
+
+    if (key_by_offset) {
+      if (!config.record_size)
+        HandleError("--key-offset and --key-len require --record-size");
+      if (config.num_cols > 1)
+        HandleError("--key-offset and --key-len cannot be used with"
+                    " a composite key");
+      if (config.key_offset >= config.record_size
+          || config.key_len > config.record_size - config.key_offset)
+        HandleError("The key must lie within the record");
+      if (!config.key_len)
+        config.key_len = config.record_size - config.key_offset;
+    }
+
+    // the file will be read as mmap
+    MappedFile file{filename, populate_limit};
+    config.first = file.first;
+    config.last = file.last;
+    config.stamp = file.stamp;
+
+    // a compressed file is told apart by its magic
+    std::unique_ptr<CompressedFile> compressed;
+    if (command.empty() && CompressedFile::IsCompressedFile(file)) {
+      if (config.check || range_query || config.batch || config.join
+          || !socket_path.empty() || !index_filenames.empty())
+        HandleError("-b, -c, -i, --range, --join and --serve cannot be used"
+                    " with a compressed FILE");
+      compressed.reset(new CompressedFile{config, file});
+      config.compressed = compressed.get();
+    }
+    auto file_size = compressed ? compressed->file_size : file.Size();
+    if (config.record_size && file_size % config.record_size)
+      HandleError("File size is not a multiple of the record size");
+
+    // the file is read through sequentially by -c and the commands,
+    // whereas the kernel readahead is of no use to the binary search.
+    // --join is left to the kernel, which reads ahead once it finds
+    // the keys dense enough to read the file sequentially
+    if (config.advise && !config.join) {
+      auto sequential = config.check || !command.empty();
+      Advise(config.first, config.last,
+             sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+    }
+
+    if (command == "sort") {
+      RunSort(config, sort_budget, tmp_dir,
+              search_keys.empty() ? "" : search_keys.front());
+      return 0;
+    }
+
+    if (command == "compress") {
+      RunCompress(config, block_size ? block_size : 1 << 14,
+                  search_keys.empty() ? filename + ".bsqz"
+                                      : search_keys.front());
+      return 0;
+    }
+
+    if (command == "index" && bloom_fp_rate) {
+      RunBloom(config, bloom_fp_rate,
+               search_keys.empty() ? filename + ".bsqb" : search_keys.front());
+      return 0;
+    }
+
+    if (command == "index") {
+      RunIndex(config, block_size ? block_size : 4096, eytzinger,
+               !search_keys.empty() ? search_keys.front()
+               : filename + (eytzinger ? ".bsqe" : ".bsqi"));
+      return 0;
+    }
+
+    // each index is told apart by its magic
+    std::vector<std::unique_ptr<MappedFile>> index_files;
+    std::unique_ptr<SparseIndex> index;
+    std::unique_ptr<EytzingerIndex> eytzinger_index;
+    std::unique_ptr<BloomFilter> bloom;
+    for (const auto &index_filename : index_filenames) {
+      if (config.check) break;
+      index_files.emplace_back(new MappedFile{index_filename});
+      auto const &index_file = *index_files.back();
+      if (EytzingerIndex::IsEytzingerIndex(index_file)) {
+        eytzinger_index.reset(new EytzingerIndex{config, index_file});
+        config.eytzinger = eytzinger_index.get();
+      } else if (BloomFilter::IsBloomFilter(index_file)) {
+        bloom.reset(new BloomFilter{config, index_file});
+        config.bloom = bloom.get();
+      } else {
+        index.reset(new SparseIndex{config, index_file});
+        config.index = index.get();
+      }
+    }
+
+    // records are found by arithmetic, which needs no table
+    std::unique_ptr<RowTable> row_table;
+    if (row_table_size && !config.record_size && !config.compressed) {
+      row_table.reset(new RowTable{file.Size(), row_table_size});
+      config.row_table = row_table.get();
+    }
+
+    if (!socket_path.empty()) {
+      if (config.check) HandleError("-c cannot be used with --serve");
+      RunServer(config, socket_path);
+      return 0;
+    }
+
+    if (config.check) {
+      RunCheck(config);
+      return 0;
+    }
+
+    if (range_query) {
+      if (!search_keys.empty()) HandleError("KEY cannot be used with --range");
+      Writer out{STDOUT_FILENO};
+      RunRange(config, range, out);
+      out.Flush();
+      return 0;
+    }
+
+    Writer out{STDOUT_FILENO};
+    if (search_keys.empty()) {
+      // the keys from stdin are searched as they are read in
+      KeyReader reader{STDIN_FILENO, config.row_sep};
+      RunPipeline(config,
+                  [&reader](std::vector<std::string> &keys, std::size_t max) {
+                    return reader.Read(keys, max);
+                  }, out);
+    } else {
+      auto first = search_keys.begin();
+      RunPipeline(config,
+                  [&search_keys, &first](std::vector<std::string> &keys,
+                                         std::size_t max) {
+                    auto n = std::min<std::size_t>(max,
+                                                   search_keys.end() - first);
+                    keys.assign(first, first + n);
+                    first += n;
+                    return n > 0;
+                  }, out);
+    }
+    out.Flush();
 
 #ifndef NDEBUG
     std::cerr << "\n";